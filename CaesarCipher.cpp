@@ -1,50 +1,62 @@
+#pragma once
 #include <cstring>
+#include <cctype>
+#include <string>
 #include <vector>
 #include <unistd.h>
 #include <cmath>
 
- char* caesarEncrypt(int key, const char* plainText) {
-    char* cipherText = new char[1024];
-
-    for (int i = 0; i < 1024; i++) {
-	if (std::isalpha(plainText[i])) {
-	    char alphaCase; 
-	    if (std::isupper(plainText[i])) {
-		alphaCase = 'A';
-	    }
-	    else {
-		alphaCase = 'a';
-	    }
-	    cipherText[i] = (((plainText[i] - alphaCase + key) % 26) + alphaCase);
+ inline char caesarShift(int key, char c) {
+    unsigned char uc = static_cast<unsigned char>(c);
+    if (std::isalpha(uc)) {
+	char alphaCase;
+	if (std::isupper(uc)) {
+	    alphaCase = 'A';
 	}
 	else {
-	    cipherText[i] = plainText[i];
+	    alphaCase = 'a';
 	}
+	return (((c - alphaCase + key % 26 + 26) % 26) + alphaCase);
     }
-    cipherText[1023] = '\0'; //no buffer overflow!
+    return c;
+ }
+
+ inline char* caesarEncrypt(int key, const char* plainText) {
+    size_t length = std::strlen(plainText);
+    char* cipherText = new char[length + 1];
+
+    for (size_t i = 0; i < length; i++) {
+	cipherText[i] = caesarShift(key, plainText[i]);
+    }
+    cipherText[length] = '\0';
     return cipherText;
  }
 
 
- char* caesarDecrypt(int key, const char* cipherText) {
-    char* plainText = new char[1024];
+ inline char* caesarDecrypt(int key, const char* cipherText) {
+    size_t length = std::strlen(cipherText);
+    char* plainText = new char[length + 1];
 
-    for (int i = 0; i < 1024; i++) {
-	if (std::isalpha(cipherText[i])) {
-	    char alphaCase; 
-	    if (std::isupper(cipherText[i])) {
-		alphaCase = 'A';
-	    }
-	    else {
-		alphaCase = 'a';
-	    }
-	    plainText[i] = (((cipherText[i] - alphaCase - key + 26) % 26) + alphaCase);
-	}
-	else {
-	    plainText[i] = cipherText[i];
-	}
+    for (size_t i = 0; i < length; i++) {
+	plainText[i] = caesarShift(-key, cipherText[i]);
     }
-    plainText[1023] = '\0';
+    plainText[length] = '\0';
     return plainText;
  }
 
+ // Length aware versions for chunks that may hold any byte, including '\0'.
+ inline std::string caesarEncrypt(int key, const std::string& plainText) {
+    std::string cipherText(plainText.size(), '\0');
+    for (size_t i = 0; i < plainText.size(); i++) {
+	cipherText[i] = caesarShift(key, plainText[i]);
+    }
+    return cipherText;
+ }
+
+ inline std::string caesarDecrypt(int key, const std::string& cipherText) {
+    std::string plainText(cipherText.size(), '\0');
+    for (size_t i = 0; i < cipherText.size(); i++) {
+	plainText[i] = caesarShift(-key, cipherText[i]);
+    }
+    return plainText;
+ }
@@ -0,0 +1,731 @@
+#pragma once
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <cmath>
+#include <random>
+#include <vector>
+#include <sstream>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <map>
+#include <set>
+#include "diffieHellman.cpp"
+#include "RSAKeys.cpp"
+#include "CaesarCipher.cpp"
+#include "ModExpBatch.cpp"
+#include "Streaming.cpp"
+#include "Compression.cpp"
+#include "Tracing.cpp"
+#include "GroupKey.cpp"
+
+// Client side of the chat protocol as a library. A ChatClientLoop drives any
+// number of ChatSessions from one thread with non-blocking sockets and
+// epoll; everything a session learns is reported through ChatCallbacks.
+// All definitions here and in the included files are inline, so any number of
+// translation units in one program may include it.
+
+inline std::vector<int> rsaEncrypt(const std::string &plaintext, int e, int n) {
+    std::vector<int> ciphertext;
+    ciphertext.reserve(plaintext.size());
+    for (char c : plaintext) {
+        ciphertext.push_back(static_cast<unsigned char>(c));
+    }
+    modExpBatch(ciphertext, e, n);
+    return ciphertext;
+}
+
+inline std::string rsaDecrypt(const std::string& encryptedMessage, int privateKey, int modulus) {
+    std::vector<int> blocks;
+    std::stringstream iss(encryptedMessage);
+    int encrypted;
+    while (iss >> encrypted) {
+        blocks.push_back(encrypted);
+    }
+    modExpBatch(blocks, privateKey, modulus);
+
+    std::string decryptedMessage(blocks.size(), '\0');
+    for (size_t i = 0; i < blocks.size(); i++) {
+        decryptedMessage[i] = static_cast<char>(blocks[i] % 256);
+    }
+    return decryptedMessage;
+}
+
+class ChatSession;
+
+// All callbacks run on the loop thread. Any of them may be left empty.
+// onStreamSent fires once a stream's last frame has been queued.
+struct ChatCallbacks {
+    std::function<void(ChatSession&)> onReady;
+    std::function<void(ChatSession&, const std::string& text)> onMessage;
+    std::function<void(ChatSession&, uint32_t streamId, const std::string& name)> onStreamBegin;
+    std::function<void(ChatSession&, uint32_t streamId, const std::string& data)> onStreamChunk;
+    std::function<void(ChatSession&, uint32_t streamId)> onStreamEnd;
+    // The server stopped relaying an incoming stream, usually because this
+    // client fell too far behind; nothing more of it arrives.
+    std::function<void(ChatSession&, uint32_t streamId, const std::string& reason)> onStreamDropped;
+    std::function<void(ChatSession&, uint32_t streamId)> onStreamSent;
+    // The server refused something this client sent, for example because
+    // the client is over its rate limit.
+    std::function<void(ChatSession&, const std::string& reason)> onError;
+    std::function<void(ChatSession&)> onClosed;
+};
+
+class ChatClientLoop {
+public:
+    ChatClientLoop();
+    ~ChatClientLoop();
+
+    // Starts connecting and returns the session right away; callbacks.onReady
+    // fires once the handshake is done. Call from the loop thread or before
+    // run(). Returns nullptr if the socket cannot be created. wantTracing
+    // asks for chat messages to be traced end to end, wantGroup for group
+    // key mode.
+    std::shared_ptr<ChatSession> connect(const std::string& address, int port, ChatCallbacks callbacks, bool wantCompression = true,
+                                         bool wantTracing = false, bool wantGroup = true);
+
+    // Runs task on the loop thread. Safe to call from any thread.
+    void post(std::function<void()> task);
+
+    // Processes socket events and posted tasks until stop() is called.
+    void run();
+
+    // Safe to call from any thread.
+    void stop();
+
+    // Like connect(), call from the loop thread or before run(); the loop
+    // thread changes the session table without a lock.
+    size_t sessionCount() const {
+        return sessions.size();
+    }
+
+private:
+    friend class ChatSession;
+    void watch(int socket, uint32_t events);
+    void forget(int socket);
+    void runTasks();
+
+    int epollFd;
+    int wakeFd;
+    std::atomic<bool> running{false};
+    std::unordered_map<int, std::shared_ptr<ChatSession>> sessions;
+    std::mutex tasksMutex;
+    std::vector<std::function<void()>> tasks;
+};
+
+// One connection to the server. Apart from the frame helpers, every method
+// must be called on the loop thread; use ChatClientLoop::post otherwise.
+class ChatSession {
+public:
+    enum State { CONNECTING, AWAIT_SERVER_RSA, AWAIT_DH_PARAMS, AWAIT_SERVER_DH, AWAIT_OPTIONS, READY, CLOSED };
+
+    ChatSession(ChatClientLoop& loop, int socket, ChatCallbacks callbacks, bool wantCompression, bool wantTracing, bool wantGroup)
+        : loop(loop), socket(socket), callbacks(std::move(callbacks)), wantCompression(wantCompression), wantTracing(wantTracing),
+          wantGroup(wantGroup) {
+        generateKeyPair(modulus, publicKey, privateKey);
+    }
+
+    // Queues a chat message, or a text stream when it is too long for one
+    // frame. Messages go under the room key once there is one, and under the
+    // session key before that. Returns false until the handshake has finished.
+    bool sendChat(const std::string& text) {
+        if (state != READY) {
+            return false;
+        }
+        if (text.size() > STREAM_CHUNK_SIZE) {
+            return sendStream(std::unique_ptr<std::istream>(new std::istringstream(text)), "") != 0;
+        }
+        QueuedFrame queued;
+        if (tracing) {
+            queued.traceId = newTraceId();
+            uint64_t started = traceNow();
+            queued.bytes = roomKeys.empty() ? frameMessage(FRAME_CHAT, 0, text, queued.traceId) : frameGroupMessage(text, queued.traceId);
+            queued.queuedAt = traceNow();
+            recordSpan("client.encrypt", queued.traceId, started, queued.queuedAt);
+        }
+        else {
+            queued.bytes = roomKeys.empty() ? frameMessage(FRAME_CHAT, 0, text) : frameGroupMessage(text);
+        }
+        chatFrames.push_back(std::move(queued));
+        flush();
+        return true;
+    }
+
+    // Sends source as a stream. Chunks are read and encrypted only as the
+    // send window drains, so any size is sent in constant memory. An empty
+    // name marks a long text message. Returns the stream id, or 0.
+    uint32_t sendStream(std::unique_ptr<std::istream> source, const std::string& name) {
+        if (state != READY) {
+            return 0;
+        }
+        uint32_t streamId = nextStreamId++;
+        outgoingStreams.push_back({streamId, std::move(source), name, false});
+        flush();
+        return streamId;
+    }
+
+    // Closes once everything queued so far has been written.
+    void closeWhenFlushed() {
+        closing = true;
+        flush();
+    }
+
+    void close() {
+        if (state == CLOSED) {
+            return;
+        }
+        state = CLOSED;
+        loop.forget(socket);
+        ::close(socket);
+        if (callbacks.onClosed) {
+            callbacks.onClosed(*this);
+        }
+    }
+
+    State getState() const {
+        return state;
+    }
+
+    bool compressionEnabled() const {
+        return compression;
+    }
+
+    bool tracingEnabled() const {
+        return tracing;
+    }
+
+    bool groupEnabled() const {
+        return group;
+    }
+
+    // Epoch of the newest room key, 0 before the first one arrives.
+    uint32_t roomEpoch() const {
+        return roomKeys.empty() ? 0 : roomKeys.rbegin()->first;
+    }
+
+    int getSocket() const {
+        return socket;
+    }
+
+    // Compresses (when negotiated and worthwhile), encrypts and frames
+    // plaintext for the server. A non-zero traceId adds a trace context,
+    // whose send time flush() fills in.
+    std::string frameMessage(uint8_t type, uint32_t streamId, const std::string& plaintext, uint64_t traceId = 0) const {
+        std::string payload;
+        uint8_t flags = 0;
+        if (traceId != 0) {
+            payload.resize(TRACE_CONTEXT_SIZE);
+            writeTraceContext(&payload[0], traceId, 0);
+            flags |= FRAME_FLAG_TRACED;
+        }
+        std::string compressed;
+        if (compression && compressMessage(plaintext, compressed)) {
+            payload += encryptForServer(compressed);
+            flags |= FRAME_FLAG_COMPRESSED;
+        }
+        else {
+            payload += encryptForServer(plaintext);
+        }
+        return encodeFrame(type, streamId, payload, flags);
+    }
+
+    // Encrypts a chat message once under the newest room key, for the server
+    // to pass on to every member unchanged.
+    std::string frameGroupMessage(const std::string& text, uint64_t traceId = 0) const {
+        const RoomKey& key = roomKeys.rbegin()->second;
+        std::string payload;
+        uint8_t flags = 0;
+        if (traceId != 0) {
+            payload.resize(TRACE_CONTEXT_SIZE);
+            writeTraceContext(&payload[0], traceId, 0);
+            flags |= FRAME_FLAG_TRACED;
+        }
+        std::string compressed;
+        const std::string* plaintext = &text;
+        if (key.compression && compressMessage(text, compressed)) {
+            plaintext = &compressed;
+            flags |= FRAME_FLAG_COMPRESSED;
+        }
+        payload += encodeCiphertext(rsaEncrypt(caesarEncrypt(key.caesarKey, *plaintext), key.publicKey, key.modulus));
+        return encodeFrame(FRAME_GROUP_CHAT, key.epoch, payload, flags);
+    }
+
+    // Decrypts a group message with the room key of its epoch.
+    bool openGroupFrame(const Frame& frame, std::string& plaintext) const {
+        auto key = roomKeys.find(frame.streamId);
+        if (key == roomKeys.end()) {
+            return false;
+        }
+        plaintext = caesarDecrypt(key->second.caesarKey, rsaDecrypt(frame.payload, key->second.privateKey, key->second.modulus));
+        if (frame.flags & FRAME_FLAG_COMPRESSED) {
+            std::string compressed = std::move(plaintext);
+            return decompressMessage(compressed, plaintext, STREAM_CHUNK_SIZE);
+        }
+        return true;
+    }
+
+    // Reverses what the server did to a relayed frame.
+    bool openFrame(const Frame& frame, std::string& plaintext) const {
+        std::string decryptedMessage = rsaDecrypt(frame.payload, privateKey, modulus);
+        plaintext = caesarDecrypt(caesarKey, decryptedMessage);
+        if (frame.flags & FRAME_FLAG_COMPRESSED) {
+            std::string compressed = std::move(plaintext);
+            return decompressMessage(compressed, plaintext, STREAM_CHUNK_SIZE);
+        }
+        return true;
+    }
+
+private:
+    friend class ChatClientLoop;
+
+    struct QueuedFrame {
+        std::string bytes;
+        uint64_t traceId = 0;
+        uint64_t queuedAt = 0;
+    };
+
+    struct OutgoingStream {
+        uint32_t streamId;
+        std::unique_ptr<std::istream> source;
+        std::string name;
+        bool begun;
+    };
+
+    std::string encryptForServer(const std::string& plaintext) const {
+        std::string caesarCiphertext = caesarEncrypt(caesarKey, plaintext);
+        return encodeCiphertext(rsaEncrypt(caesarCiphertext, serverPublicKey, serverModulus));
+    }
+
+    void onConnected() {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+            std::cerr << "Connection failed: " << std::strerror(error) << std::endl;
+            close();
+            return;
+        }
+        state = AWAIT_SERVER_RSA;
+        flush();
+    }
+
+    void onReadable() {
+        char buffer[16384];
+        while (state != CLOSED) {
+            ssize_t valread = read(socket, buffer, sizeof(buffer));
+            if (valread == 0 || (valread < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                close();
+                return;
+            }
+            if (valread < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+
+            reader.append(buffer, valread);
+            Frame frame;
+            bool malformed;
+            while (state != CLOSED && reader.next(frame, malformed)) {
+                handleFrame(frame);
+            }
+            if (malformed) {
+                std::cerr << "Malformed frame from server." << std::endl;
+                close();
+                return;
+            }
+        }
+    }
+
+    void handleFrame(const Frame& frame) {
+        if (state != READY) {
+            handleHandshake(frame);
+            return;
+        }
+
+        if (frame.type == FRAME_PING) {
+            chatFrames.push_back({encodeFrame(FRAME_PONG, 0, "")});
+            flush();
+            return;
+        }
+        if (frame.type == FRAME_PONG) {
+            return;
+        }
+        if (frame.type == FRAME_ERROR) {
+            if (frame.streamId != 0 && incomingStreams.erase(frame.streamId) != 0) {
+                if (callbacks.onStreamDropped) {
+                    callbacks.onStreamDropped(*this, frame.streamId, frame.payload);
+                }
+                return;
+            }
+            if (callbacks.onError) {
+                callbacks.onError(*this, frame.payload);
+            }
+            return;
+        }
+
+        // Chunks of a stream whose start this session never saw, because it
+        // joined mid-transfer, have nowhere to go.
+        if ((frame.type == FRAME_STREAM_CHUNK || frame.type == FRAME_STREAM_END) && incomingStreams.count(frame.streamId) == 0) {
+            return;
+        }
+
+        uint64_t receivedAt = traceNow();
+        std::string plaintext;
+        bool opened = frame.type == FRAME_GROUP_CHAT ? openGroupFrame(frame, plaintext) : openFrame(frame, plaintext);
+        if (!opened) {
+            std::cerr << "Dropping message that could not be decrypted." << std::endl;
+            return;
+        }
+        if (frame.traceId != 0) {
+            recordSpan("network", frame.traceId, frame.sentAt, receivedAt);
+            recordSpan("client.decrypt", frame.traceId, receivedAt, traceNow());
+        }
+
+        if (frame.type == FRAME_CHAT || frame.type == FRAME_GROUP_CHAT) {
+            if (callbacks.onMessage) {
+                callbacks.onMessage(*this, plaintext);
+            }
+        }
+        else if (frame.type == FRAME_GROUP_KEY) {
+            RoomKey key;
+            if (!decodeRoomKey(plaintext, key) || key.epoch != frame.streamId) {
+                std::cerr << "Ignoring malformed room key." << std::endl;
+                return;
+            }
+            roomKeys[key.epoch] = key;
+            while (roomKeys.size() > ROOM_KEY_EPOCHS) {
+                roomKeys.erase(roomKeys.begin());
+            }
+        }
+        else if (frame.type == FRAME_STREAM_BEGIN) {
+            incomingStreams.insert(frame.streamId);
+            if (callbacks.onStreamBegin) {
+                callbacks.onStreamBegin(*this, frame.streamId, plaintext);
+            }
+        }
+        else if (frame.type == FRAME_STREAM_CHUNK) {
+            if (callbacks.onStreamChunk) {
+                callbacks.onStreamChunk(*this, frame.streamId, plaintext);
+            }
+        }
+        else if (frame.type == FRAME_STREAM_END) {
+            incomingStreams.erase(frame.streamId);
+            if (callbacks.onStreamEnd) {
+                callbacks.onStreamEnd(*this, frame.streamId);
+            }
+        }
+    }
+
+    // Client half of the RSA, Diffie Hellman and options exchange, one step
+    // per server frame.
+    void handleHandshake(const Frame& frame) {
+        bool ok = frame.type == (state == AWAIT_OPTIONS ? FRAME_OPTIONS : FRAME_HANDSHAKE);
+
+        if (ok && state == AWAIT_SERVER_RSA) {
+            ok = parseKeyPair(frame.payload, serverPublicKey, serverModulus);
+            if (ok) {
+                handshakeFrames.push_back({encodeFrame(FRAME_HANDSHAKE, 0, std::to_string(publicKey) + "," + std::to_string(modulus))});
+                state = AWAIT_DH_PARAMS;
+            }
+        }
+        else if (ok && state == AWAIT_DH_PARAMS) {
+            int gVal;
+            ok = parseKeyPair(frame.payload, pVal, gVal) && pVal > 1;
+            if (ok) {
+                clientDHprivate = genPrivate(pVal);
+                int clientDHpublic = computePublic(gVal, pVal, clientDHprivate);
+                handshakeFrames.push_back({encodeFrame(FRAME_HANDSHAKE, 0, std::to_string(clientDHpublic))});
+                state = AWAIT_SERVER_DH;
+            }
+        }
+        else if (ok && state == AWAIT_SERVER_DH) {
+            int serverDHPublic;
+            ok = parseKey(frame.payload, serverDHPublic);
+            if (ok) {
+                caesarKey = resolveKey(serverDHPublic, clientDHprivate, pVal);
+                std::string options = wantCompression ? COMPRESSION_CODEC : "";
+                if (wantTracing) {
+                    addOption(options, TRACE_OPTION);
+                }
+                if (wantGroup) {
+                    addOption(options, GROUP_OPTION);
+                }
+                addOption(options, HEARTBEAT_OPTION);
+                handshakeFrames.push_back({encodeFrame(FRAME_OPTIONS, 0, options)});
+                state = AWAIT_OPTIONS;
+            }
+        }
+        else if (ok && state == AWAIT_OPTIONS) {
+            compression = hasOption(frame.payload, COMPRESSION_CODEC);
+            tracing = hasOption(frame.payload, TRACE_OPTION);
+            group = hasOption(frame.payload, GROUP_OPTION);
+            state = READY;
+            if (callbacks.onReady) {
+                callbacks.onReady(*this);
+            }
+        }
+
+        if (!ok) {
+            std::cerr << "Handshake with server failed." << std::endl;
+            close();
+            return;
+        }
+        flush();
+    }
+
+    // Keeps up to STREAM_WINDOW encrypted chunks ready, taking one chunk from
+    // each outgoing stream in turn so concurrent transfers share the link.
+    void refillStreams() {
+        while (bulkFrames.size() < STREAM_WINDOW && !outgoingStreams.empty()) {
+            OutgoingStream stream = std::move(outgoingStreams.front());
+            outgoingStreams.pop_front();
+
+            if (!stream.begun) {
+                bulkFrames.push_back({frameMessage(FRAME_STREAM_BEGIN, stream.streamId, stream.name)});
+                stream.begun = true;
+                outgoingStreams.push_back(std::move(stream));
+                continue;
+            }
+
+            std::string chunk(STREAM_CHUNK_SIZE, '\0');
+            stream.source->read(&chunk[0], STREAM_CHUNK_SIZE);
+            size_t length = stream.source->gcount();
+            if (length > 0) {
+                chunk.resize(length);
+                bulkFrames.push_back({frameMessage(FRAME_STREAM_CHUNK, stream.streamId, chunk)});
+                outgoingStreams.push_back(std::move(stream));
+            }
+            else {
+                bulkFrames.push_back({encodeFrame(FRAME_STREAM_END, stream.streamId, "")});
+                if (callbacks.onStreamSent) {
+                    callbacks.onStreamSent(*this, stream.streamId);
+                }
+            }
+        }
+    }
+
+    // Writes as much as the socket takes: handshake frames first, then chat,
+    // then stream chunks.
+    void flush() {
+        if (state == CONNECTING || state == CLOSED) {
+            return;
+        }
+        while (true) {
+            if (writeOffset == writing.bytes.size()) {
+                writing = QueuedFrame();
+                writeOffset = 0;
+                refillStreams();
+                std::deque<QueuedFrame>* source = !handshakeFrames.empty() ? &handshakeFrames
+                                                : !chatFrames.empty() ? &chatFrames
+                                                : !bulkFrames.empty() ? &bulkFrames : nullptr;
+                if (source == nullptr) {
+                    break;
+                }
+                writing = std::move(source->front());
+                source->pop_front();
+                if (writing.traceId != 0) {
+                    stampTraceTime(&writing.bytes[0], traceNow());
+                }
+            }
+
+            ssize_t valsent = send(socket, writing.bytes.data() + writeOffset, writing.bytes.size() - writeOffset, MSG_NOSIGNAL);
+            if (valsent < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                close();
+                return;
+            }
+            writeOffset += valsent;
+            if (writeOffset == writing.bytes.size() && writing.traceId != 0) {
+                recordSpan("client.send", writing.traceId, writing.queuedAt, traceNow());
+            }
+        }
+
+        bool pending = writeOffset < writing.bytes.size();
+        if (!pending && closing) {
+            close();
+            return;
+        }
+        uint32_t events = EPOLLIN | (pending ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+        if (events != watchedEvents) {
+            loop.watch(socket, events);
+            watchedEvents = events;
+        }
+    }
+
+    ChatClientLoop& loop;
+    int socket;
+    ChatCallbacks callbacks;
+    bool wantCompression;
+    bool wantTracing;
+    bool wantGroup;
+    State state = CONNECTING;
+    bool closing = false;
+    uint32_t watchedEvents = 0;
+
+    int publicKey, privateKey, modulus;
+    int serverPublicKey = 0, serverModulus = 0;
+    int pVal = 0, clientDHprivate = 0, caesarKey = 0;
+    bool compression = false;
+    bool tracing = false;
+    bool group = false;
+    std::map<uint32_t, RoomKey> roomKeys;
+
+    FrameReader reader;
+    std::deque<QueuedFrame> handshakeFrames;
+    std::deque<QueuedFrame> chatFrames;
+    std::deque<QueuedFrame> bulkFrames;
+    std::deque<OutgoingStream> outgoingStreams;
+    // Relay ids of the streams being received.
+    std::set<uint32_t> incomingStreams;
+    QueuedFrame writing;
+    size_t writeOffset = 0;
+    uint32_t nextStreamId = 1;
+};
+
+inline ChatClientLoop::ChatClientLoop() {
+    epollFd = epoll_create1(0);
+    wakeFd = eventfd(0, EFD_NONBLOCK);
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = wakeFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+}
+
+inline ChatClientLoop::~ChatClientLoop() {
+    for (auto& session : sessions) {
+        ::close(session.first);
+    }
+    ::close(wakeFd);
+    ::close(epollFd);
+}
+
+inline std::shared_ptr<ChatSession> ChatClientLoop::connect(const std::string& address, int port, ChatCallbacks callbacks, bool wantCompression,
+                                                     bool wantTracing, bool wantGroup) {
+    struct sockaddr_in serverAddress{};
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &serverAddress.sin_addr) <= 0) {
+        return nullptr;
+    }
+
+    int clientSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (clientSocket < 0) {
+        return nullptr;
+    }
+
+    auto session = std::make_shared<ChatSession>(*this, clientSocket, std::move(callbacks), wantCompression, wantTracing, wantGroup);
+    sessions[clientSocket] = session;
+
+    if (::connect(clientSocket, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) == 0) {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = clientSocket;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSocket, &event);
+        session->state = ChatSession::AWAIT_SERVER_RSA;
+    }
+    else if (errno == EINPROGRESS) {
+        epoll_event event{};
+        event.events = EPOLLOUT;
+        event.data.fd = clientSocket;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSocket, &event);
+    }
+    else {
+        sessions.erase(clientSocket);
+        ::close(clientSocket);
+        return nullptr;
+    }
+    return session;
+}
+
+inline void ChatClientLoop::post(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(tasksMutex);
+        tasks.push_back(std::move(task));
+    }
+    uint64_t one = 1;
+    if (write(wakeFd, &one, sizeof(one)) < 0) {
+        // The counter is already non-zero, so the loop will wake anyway.
+    }
+}
+
+inline void ChatClientLoop::stop() {
+    running = false;
+    post([] {});
+}
+
+inline void ChatClientLoop::run() {
+    running = true;
+    epoll_event events[256];
+    while (running) {
+        int count = epoll_wait(epollFd, events, 256, -1);
+        if (count < 0 && errno != EINTR) {
+            perror("epoll_wait failed");
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if (fd == wakeFd) {
+                uint64_t value;
+                if (read(wakeFd, &value, sizeof(value)) < 0) {
+                    // Nothing to drain.
+                }
+                runTasks();
+                continue;
+            }
+
+            auto it = sessions.find(fd);
+            if (it == sessions.end()) {
+                continue;
+            }
+            std::shared_ptr<ChatSession> session = it->second;
+            if (session->state == ChatSession::CONNECTING) {
+                session->onConnected();
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                session->onReadable();
+            }
+            if ((events[i].events & EPOLLOUT) && session->state != ChatSession::CLOSED) {
+                session->flush();
+            }
+        }
+    }
+}
+
+inline void ChatClientLoop::runTasks() {
+    std::vector<std::function<void()>> pending;
+    {
+        std::lock_guard<std::mutex> lock(tasksMutex);
+        pending.swap(tasks);
+    }
+    for (auto& task : pending) {
+        task();
+    }
+}
+
+inline void ChatClientLoop::watch(int socket, uint32_t events) {
+    epoll_event event{};
+    event.events = events;
+    event.data.fd = socket;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, socket, &event);
+}
+
+inline void ChatClientLoop::forget(int socket) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, socket, nullptr);
+    sessions.erase(socket);
+}
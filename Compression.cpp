@@ -0,0 +1,120 @@
+#pragma once
+#include <algorithm>
+#include <string>
+#include <zlib.h>
+
+// Name both sides put in FRAME_OPTIONS to agree on compression. The suffix
+// versions CHAT_DICTIONARY; change it whenever the dictionary changes.
+inline const char* const COMPRESSION_CODEC = "deflate-chat1";
+
+// Messages shorter than this are sent as is; deflate cannot win on them.
+const size_t COMPRESS_MIN_SIZE = 32;
+
+// Preset dictionary of common chat text. Deflate looks back into it from
+// the first byte, so even short messages find matches. The most frequent
+// strings go last since they are cheapest to reference from there.
+const char CHAT_DICTIONARY[] =
+    "http://https://www..com.org.net/ :) :( :D ;) lol lmao brb btw idk imo omg thx "
+    "tomorrow tonight today yesterday morning afternoon evening weekend "
+    "Monday Tuesday Wednesday Thursday Friday Saturday Sunday "
+    "meeting call later soon minutes hour back home work file send sent "
+    "please thanks thank you sorry okay sure yeah yes no maybe "
+    "could would should about there their they're we're you're I'm it's don't can't "
+    "what when where which who why how have has had will just like know think "
+    "good great nice cool right really going get got want need see "
+    "Hello hello Hi hi Hey hey ok OK "
+    " the and that this with for you are was not but your from is in it to of a I ";
+
+inline z_stream* compressorStream() {
+    thread_local z_stream* stream = nullptr;
+    if (stream == nullptr) {
+        stream = new z_stream();
+        if (deflateInit2(stream, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            delete stream;
+            stream = nullptr;
+        }
+    }
+    else {
+        deflateReset(stream);
+    }
+    return stream;
+}
+
+inline z_stream* decompressorStream() {
+    thread_local z_stream* stream = nullptr;
+    if (stream == nullptr) {
+        stream = new z_stream();
+        if (inflateInit2(stream, -MAX_WBITS) != Z_OK) {
+            delete stream;
+            stream = nullptr;
+        }
+    }
+    else {
+        inflateReset(stream);
+    }
+    return stream;
+}
+
+// Deflates length bytes at in against CHAT_DICTIONARY into out. Returns
+// false when the input is under COMPRESS_MIN_SIZE or does not get smaller
+// than capacity, in which case the caller sends it uncompressed.
+inline bool compressInto(const char* in, size_t length, char* out, size_t capacity, size_t& outLength) {
+    if (length < COMPRESS_MIN_SIZE) {
+        return false;
+    }
+    z_stream* stream = compressorStream();
+    if (stream == nullptr) {
+        return false;
+    }
+    deflateSetDictionary(stream, reinterpret_cast<const Bytef*>(CHAT_DICTIONARY), sizeof(CHAT_DICTIONARY) - 1);
+
+    stream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in));
+    stream->avail_in = length;
+    stream->next_out = reinterpret_cast<Bytef*>(out);
+    stream->avail_out = std::min(capacity, length);
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+        return false;
+    }
+    outLength = stream->total_out;
+    return true;
+}
+
+// Inflates a message produced by compressInto(). Fails instead of writing
+// more than maxSize bytes.
+inline bool decompressInto(const char* in, size_t length, char* out, size_t maxSize, size_t& outLength) {
+    z_stream* stream = decompressorStream();
+    if (stream == nullptr) {
+        return false;
+    }
+    inflateSetDictionary(stream, reinterpret_cast<const Bytef*>(CHAT_DICTIONARY), sizeof(CHAT_DICTIONARY) - 1);
+
+    stream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in));
+    stream->avail_in = length;
+    stream->next_out = reinterpret_cast<Bytef*>(out);
+    stream->avail_out = maxSize;
+    if (inflate(stream, Z_FINISH) != Z_STREAM_END) {
+        return false;
+    }
+    outLength = stream->total_out;
+    return true;
+}
+
+inline bool compressMessage(const std::string& plaintext, std::string& compressed) {
+    compressed.resize(plaintext.size());
+    size_t length;
+    if (!compressInto(plaintext.data(), plaintext.size(), &compressed[0], compressed.size(), length)) {
+        return false;
+    }
+    compressed.resize(length);
+    return true;
+}
+
+inline bool decompressMessage(const std::string& compressed, std::string& plaintext, size_t maxSize) {
+    plaintext.resize(maxSize);
+    size_t length;
+    if (!decompressInto(compressed.data(), compressed.size(), &plaintext[0], maxSize, length)) {
+        return false;
+    }
+    plaintext.resize(length);
+    return true;
+}
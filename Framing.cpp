@@ -0,0 +1,270 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+// Every message on the wire is a frame: 1 byte type, 1 byte flags, 4 byte
+// stream id and 4 byte payload length (network order) followed by the payload.
+const int FRAME_HEADER_SIZE = 10;
+const uint32_t MAX_FRAME_PAYLOAD = 64 * 1024;
+
+enum FrameType : uint8_t {
+    FRAME_HANDSHAKE = 1,
+    FRAME_CHAT = 2,
+    FRAME_STREAM_BEGIN = 3,
+    FRAME_STREAM_CHUNK = 4,
+    FRAME_STREAM_END = 5,
+    FRAME_OPTIONS = 6,
+    // Room key for one member, stream id is the epoch.
+    FRAME_GROUP_KEY = 7,
+    // Chat message under a room key, stream id is the epoch.
+    FRAME_GROUP_CHAT = 8,
+    // Liveness probe and its answer, with empty unencrypted payloads.
+    FRAME_PING = 9,
+    FRAME_PONG = 10,
+    // Server notice that a frame was refused, with an unencrypted reason.
+    FRAME_ERROR = 11
+};
+
+enum FrameFlag : uint8_t {
+    FRAME_FLAG_COMPRESSED = 1,
+    FRAME_FLAG_TRACED = 2
+};
+
+// Name both sides put in FRAME_OPTIONS when they answer FRAME_PING.
+inline const char* const HEARTBEAT_OPTION = "heartbeat1";
+
+// A traced frame's payload starts with an 8 byte trace id and the 8 byte
+// CLOCK_MONOTONIC nanosecond time it was sent, both in network order.
+const size_t TRACE_CONTEXT_SIZE = 16;
+
+struct Frame {
+    uint8_t type;
+    uint8_t flags;
+    uint32_t streamId;
+    std::string payload;
+    // Taken out of the payload of traced frames, zero otherwise.
+    uint64_t traceId = 0;
+    uint64_t sentAt = 0;
+};
+
+inline bool readFully(int socket, char* buffer, size_t length) {
+    size_t received = 0;
+    while (received < length) {
+        ssize_t valread = read(socket, buffer + received, length - received);
+        if (valread <= 0) {
+            return false;
+        }
+        received += valread;
+    }
+    return true;
+}
+
+inline bool writeFully(int socket, const char* buffer, size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+        ssize_t valsent = send(socket, buffer + sent, length - sent, MSG_NOSIGNAL);
+        if (valsent <= 0) {
+            return false;
+        }
+        sent += valsent;
+    }
+    return true;
+}
+
+inline void writeFrameHeader(char* header, uint8_t type, uint32_t streamId, uint32_t length, uint8_t flags) {
+    uint32_t netStreamId = htonl(streamId);
+    uint32_t netLength = htonl(length);
+    header[0] = static_cast<char>(type);
+    header[1] = static_cast<char>(flags);
+    std::memcpy(header + 2, &netStreamId, 4);
+    std::memcpy(header + 6, &netLength, 4);
+}
+
+inline void writeTraceContext(char* context, uint64_t traceId, uint64_t sentAt) {
+    uint64_t netTraceId = htobe64(traceId);
+    uint64_t netSentAt = htobe64(sentAt);
+    std::memcpy(context, &netTraceId, 8);
+    std::memcpy(context + 8, &netSentAt, 8);
+}
+
+// Rewrites the send time of an encoded traced frame just before it goes out.
+inline void stampTraceTime(char* frame, uint64_t sentAt) {
+    uint64_t netSentAt = htobe64(sentAt);
+    std::memcpy(frame + FRAME_HEADER_SIZE + 8, &netSentAt, 8);
+}
+
+// Moves the trace context of a traced frame out of its payload. Returns
+// false if the payload is too short to hold one.
+inline bool takeTraceContext(Frame& frame) {
+    frame.traceId = 0;
+    frame.sentAt = 0;
+    if (!(frame.flags & FRAME_FLAG_TRACED)) {
+        return true;
+    }
+    if (frame.payload.size() < TRACE_CONTEXT_SIZE) {
+        return false;
+    }
+    uint64_t netTraceId, netSentAt;
+    std::memcpy(&netTraceId, frame.payload.data(), 8);
+    std::memcpy(&netSentAt, frame.payload.data() + 8, 8);
+    frame.traceId = be64toh(netTraceId);
+    frame.sentAt = be64toh(netSentAt);
+    frame.payload.erase(0, TRACE_CONTEXT_SIZE);
+    return true;
+}
+
+inline std::string encodeFrame(uint8_t type, uint32_t streamId, const std::string& payload, uint8_t flags = 0) {
+    std::string frame(FRAME_HEADER_SIZE, '\0');
+    writeFrameHeader(&frame[0], type, streamId, payload.size(), flags);
+    frame += payload;
+    return frame;
+}
+
+inline bool sendFrame(int socket, uint8_t type, uint32_t streamId, const std::string& payload, uint8_t flags = 0) {
+    if (payload.size() > MAX_FRAME_PAYLOAD) {
+        return false;
+    }
+    std::string frame = encodeFrame(type, streamId, payload, flags);
+    return writeFully(socket, frame.data(), frame.size());
+}
+
+// Fills in everything but the payload and returns false for oversized frames.
+inline bool decodeFrameHeader(const char* header, Frame& frame, uint32_t& length) {
+    uint32_t netStreamId, netLength;
+    std::memcpy(&netStreamId, header + 2, 4);
+    std::memcpy(&netLength, header + 6, 4);
+    length = ntohl(netLength);
+    if (length > MAX_FRAME_PAYLOAD) {
+        return false;
+    }
+
+    frame.type = static_cast<uint8_t>(header[0]);
+    frame.flags = static_cast<uint8_t>(header[1]);
+    frame.streamId = ntohl(netStreamId);
+    return true;
+}
+
+inline bool receiveFrame(int socket, Frame& frame) {
+    char header[FRAME_HEADER_SIZE];
+    if (!readFully(socket, header, FRAME_HEADER_SIZE)) {
+        return false;
+    }
+
+    uint32_t length;
+    if (!decodeFrameHeader(header, frame, length)) {
+        return false;
+    }
+    frame.payload.resize(length);
+    if (length > 0 && !readFully(socket, &frame.payload[0], length)) {
+        return false;
+    }
+    return takeTraceContext(frame);
+}
+
+// Reassembles frames from whatever a non-blocking read returned.
+class FrameReader {
+public:
+    void append(const char* data, size_t length) {
+        buffer.append(data, length);
+    }
+
+    // Pops the next complete frame. Returns false when more bytes are needed
+    // or, with malformed set, when the stream cannot be parsed.
+    bool next(Frame& frame, bool& malformed) {
+        malformed = false;
+        size_t available = buffer.size() - offset;
+        uint32_t length;
+        if (available < FRAME_HEADER_SIZE) {
+            compact();
+            return false;
+        }
+        if (!decodeFrameHeader(buffer.data() + offset, frame, length)) {
+            malformed = true;
+            return false;
+        }
+        if (available < FRAME_HEADER_SIZE + length) {
+            compact();
+            return false;
+        }
+        frame.payload.assign(buffer, offset + FRAME_HEADER_SIZE, length);
+        offset += FRAME_HEADER_SIZE + length;
+        if (!takeTraceContext(frame)) {
+            malformed = true;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    void compact() {
+        if (offset > 0) {
+            buffer.erase(0, offset);
+            offset = 0;
+        }
+    }
+
+    std::string buffer;
+    size_t offset = 0;
+};
+
+// RSA ciphertext travels as space separated decimal blocks.
+inline std::string encodeCiphertext(const std::vector<int>& ciphertext) {
+    std::stringstream ss;
+    for (int encryptedChar : ciphertext) {
+        ss << encryptedChar << " ";
+    }
+    return ss.str();
+}
+
+// FRAME_OPTIONS payloads are comma separated feature names.
+inline void addOption(std::string& options, const std::string& name) {
+    if (!options.empty()) {
+        options += ",";
+    }
+    options += name;
+}
+
+inline bool hasOption(const std::string& options, const std::string& name) {
+    std::stringstream ss(options);
+    std::string option;
+    while (std::getline(ss, option, ',')) {
+        if (option == name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Handshake payloads are one decimal key or two separated by a comma.
+inline bool parseKeyPair(const std::string& keyMessage, int& first, int& second) {
+    size_t delimiterPos = keyMessage.find(",");
+    if (delimiterPos == std::string::npos) {
+        return false;
+    }
+    try {
+        first = std::stoi(keyMessage.substr(0, delimiterPos));
+        second = std::stoi(keyMessage.substr(delimiterPos + 1));
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+inline bool parseKey(const std::string& keyMessage, int& key) {
+    try {
+        key = std::stoi(keyMessage);
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
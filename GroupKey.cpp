@@ -0,0 +1,46 @@
+#pragma once
+#include <cstdint>
+#include <istream>
+#include <sstream>
+#include <string>
+
+// Group key mode. The server hands every member a shared room key, wrapped
+// for each member with that member's own RSA and Caesar keys. Senders then
+// encrypt a chat message once under the room key, and the server forwards
+// the same bytes to every member without decrypting them. The room key is
+// replaced, with a new epoch number, whenever members join or leave, so a
+// newcomer cannot read earlier messages and a leaver cannot read later ones.
+
+// Name both sides put in FRAME_OPTIONS to agree on group key mode.
+inline const char* const GROUP_OPTION = "group1";
+
+// Members keep the keys of this many epochs, so messages sent just before a
+// rotation still decrypt. The server relays nothing older.
+const uint32_t ROOM_KEY_EPOCHS = 2;
+
+struct RoomKey {
+    uint32_t epoch = 0;
+    int publicKey = 0;
+    int privateKey = 0;
+    int modulus = 0;
+    int caesarKey = 0;
+    // Senders compress only when every member at rotation time agreed to it.
+    bool compression = false;
+};
+
+inline std::string encodeRoomKey(const RoomKey& key) {
+    std::ostringstream record;
+    record << key.epoch << " " << key.publicKey << " " << key.privateKey << " " << key.modulus << " " << key.caesarKey << " "
+           << key.compression;
+    return record.str();
+}
+
+inline bool readRoomKey(std::istream& fields, RoomKey& key) {
+    fields >> key.epoch >> key.publicKey >> key.privateKey >> key.modulus >> key.caesarKey >> key.compression;
+    return !fields.fail();
+}
+
+inline bool decodeRoomKey(const std::string& record, RoomKey& key) {
+    std::istringstream fields(record);
+    return readRoomKey(fields, key) && key.epoch != 0 && key.modulus > 255;
+}
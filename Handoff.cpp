@@ -0,0 +1,274 @@
+#pragma once
+#include <iostream>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// Zero downtime upgrades. A new server binary started with --upgrade
+// connects to the running server over upgradeSocketPath(), and the running
+// server quiesces its sessions and passes over the listening socket, every
+// client socket and the keys needed to keep using them, one record per
+// message with the descriptor attached as SCM_RIGHTS.
+
+// The upgrade socket lives in a directory of its own per user, which only
+// that user may enter; both ends also check the other's uid.
+const char* UPGRADE_SOCKET_DIR_PREFIX = "/tmp/secure-chat-";
+const char* UPGRADE_SOCKET_NAME = "upgrade.sock";
+
+// Longest a record may be; a session with many open streams is the largest.
+const size_t MAX_HANDOFF_RECORD = 64 * 1024;
+
+// How long the running server waits for sessions to reach a frame boundary
+// and for their queued frames to drain before it gives up on an upgrade.
+const std::chrono::milliseconds HANDOFF_TIMEOUT(10000);
+
+// Session threads wait for their next frame through the gate. Closing the
+// gate makes every one of them stop at a frame boundary and park, leaving
+// any unread bytes in the kernel for whoever owns the socket next.
+class SessionGate {
+public:
+    SessionGate() {
+        wakeFd = eventfd(0, EFD_NONBLOCK);
+    }
+
+    // Blocks until socket has data. Returns false if the gate closed first.
+    bool waitReadable(int socket) {
+        pollfd fds[2] = {{socket, POLLIN, 0}, {wakeFd, POLLIN, 0}};
+        while (true) {
+            if (isClosed()) {
+                return false;
+            }
+            int ready = poll(fds, 2, -1);
+            if (ready < 0 && errno != EINTR) {
+                // Let the read report the error.
+                return true;
+            }
+            if (ready > 0 && fds[1].revents == 0) {
+                return true;
+            }
+        }
+    }
+
+    // Records a session's stream state and blocks until the gate reopens.
+    // If the upgrade goes through the process exits while parked.
+    void park(int socket, const std::string& streams) {
+        std::unique_lock<std::mutex> lock(mutex);
+        parkedStreams[socket] = streams;
+        parkedChanged.notify_all();
+        reopened.wait(lock, [&] { return !closed; });
+        parkedStreams.erase(socket);
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) < 0) {
+            // The counter is already non-zero, so waiters wake anyway.
+        }
+    }
+
+    void reopen() {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t value;
+        if (read(wakeFd, &value, sizeof(value)) < 0) {
+            // Nothing to drain.
+        }
+        closed = false;
+        reopened.notify_all();
+    }
+
+    // Waits until expected() sessions are parked, rechecking whenever one
+    // parks. Returns false on timeout.
+    template <typename Expected>
+    bool waitParked(Expected expected, std::chrono::milliseconds timeout) {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (parkedStreams.size() < expected()) {
+            // Sessions may also end instead of parking, so poll as well.
+            if (parkedChanged.wait_for(lock, std::chrono::milliseconds(50)) == std::cv_status::timeout &&
+                std::chrono::steady_clock::now() >= deadline) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::map<int, std::string> parked() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return parkedStreams;
+    }
+
+    bool isClosed() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return closed;
+    }
+
+private:
+    int wakeFd;
+    std::mutex mutex;
+    std::condition_variable reopened;
+    std::condition_variable parkedChanged;
+    std::map<int, std::string> parkedStreams;
+    bool closed = false;
+};
+
+std::string upgradeSocketDirectory() {
+    return UPGRADE_SOCKET_DIR_PREFIX + std::to_string(getuid());
+}
+
+std::string upgradeSocketPath() {
+    return upgradeSocketDirectory() + "/" + UPGRADE_SOCKET_NAME;
+}
+
+// Checks that the upgrade directory is a real directory, not a symlink,
+// owned by us and closed to everyone else. With create it is made first if
+// missing.
+bool checkUpgradeDirectory(bool create) {
+    std::string directory = upgradeSocketDirectory();
+    if (create && mkdir(directory.c_str(), 0700) < 0 && errno != EEXIST) {
+        return false;
+    }
+    struct stat info;
+    if (lstat(directory.c_str(), &info) < 0) {
+        return false;
+    }
+    if (!S_ISDIR(info.st_mode) || info.st_uid != getuid() || (info.st_mode & 0077) != 0) {
+        std::cerr << "Refusing upgrade directory " << directory << ": not a private directory owned by this user" << std::endl;
+        errno = EACCES;
+        return false;
+    }
+    return true;
+}
+
+// True if the process at the other end of channel runs as our user.
+bool peerIsOwner(int channel) {
+    ucred credentials{};
+    socklen_t length = sizeof(credentials);
+    if (getsockopt(channel, SOL_SOCKET, SO_PEERCRED, &credentials, &length) < 0) {
+        return false;
+    }
+    return credentials.uid == getuid();
+}
+
+// Listens for an upgrading server on upgradeSocketPath(), replacing any
+// socket file a previous process left behind. Callers must still check
+// accepted channels with peerIsOwner().
+int openUpgradeSocket() {
+    if (!checkUpgradeDirectory(true)) {
+        return -1;
+    }
+    int listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listener < 0) {
+        return -1;
+    }
+    std::string path = upgradeSocketPath();
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    unlink(path.c_str());
+    mode_t oldMask = umask(0077);
+    bool bound = bind(listener, (sockaddr*)&address, sizeof(address)) == 0;
+    umask(oldMask);
+    if (!bound || listen(listener, 1) < 0) {
+        close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+// Connects to the running server, refusing one that runs as another user.
+int connectUpgradeSocket() {
+    if (!checkUpgradeDirectory(false)) {
+        return -1;
+    }
+    int channel = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (channel < 0) {
+        return -1;
+    }
+    std::string path = upgradeSocketPath();
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    if (connect(channel, (sockaddr*)&address, sizeof(address)) < 0) {
+        close(channel);
+        return -1;
+    }
+    if (!peerIsOwner(channel)) {
+        std::cerr << "Upgrade socket is served by another user" << std::endl;
+        close(channel);
+        errno = EACCES;
+        return -1;
+    }
+    return channel;
+}
+
+// Sends one record, with fd attached when it is not -1.
+bool sendRecord(int channel, const std::string& record, int fd = -1) {
+    iovec data{const_cast<char*>(record.data()), record.size()};
+    msghdr message{};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    if (fd >= 0) {
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    }
+    ssize_t valsent;
+    do {
+        valsent = sendmsg(channel, &message, MSG_NOSIGNAL);
+    } while (valsent < 0 && errno == EINTR);
+    return valsent == static_cast<ssize_t>(record.size());
+}
+
+// Receives one record. fd is set to the attached descriptor, or -1.
+bool receiveRecord(int channel, std::string& record, int& fd) {
+    record.resize(MAX_HANDOFF_RECORD);
+    iovec data{&record[0], record.size()};
+    msghdr message{};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t valread;
+    do {
+        valread = recvmsg(channel, &message, MSG_CMSG_CLOEXEC);
+    } while (valread < 0 && errno == EINTR);
+
+    fd = -1;
+    for (cmsghdr* header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            std::memcpy(&fd, CMSG_DATA(header), sizeof(int));
+        }
+    }
+    if (valread <= 0 || (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+        return false;
+    }
+    record.resize(valread);
+    return true;
+}
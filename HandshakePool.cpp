@@ -0,0 +1,344 @@
+#pragma once
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "diffieHellman.cpp"
+#include "Framing.cpp"
+#include "Compression.cpp"
+#include "Tracing.cpp"
+#include "GroupKey.cpp"
+#include "TimerWheel.cpp"
+
+// Server half of the RSA, Diffie Hellman and options exchange, run as
+// non-blocking state machines on a fixed set of worker threads so slow or
+// hostile peers cannot tie up more than that many threads. Only sockets that
+// finish the exchange get a session thread of their own.
+
+const int HANDSHAKE_WORKERS = 2;
+const int MAX_PENDING_HANDSHAKES = 512;
+const int MAX_HANDSHAKES_PER_IP = 64;
+const std::chrono::milliseconds HANDSHAKE_TIMEOUT(5000);
+
+// Everything a session needs from a finished handshake.
+struct HandshakeResult {
+    int socket;
+    int clientPublicKey;
+    int clientModulus;
+    int clientDHpublic;
+    int serverDHPrivate;
+    int pVal;
+    bool compression;
+    bool tracing;
+    bool group;
+    bool heartbeat;
+};
+
+struct PendingHandshake {
+    enum State { AWAIT_CLIENT_RSA, AWAIT_CLIENT_DH, AWAIT_OPTIONS, DONE };
+
+    int socket;
+    uint32_t ip;
+    State state = AWAIT_CLIENT_RSA;
+    // Fires HANDSHAKE_TIMEOUT after admission and shuts the socket down, so
+    // the worker sees it hang up and fails the handshake.
+    TimerNode deadline;
+    std::atomic<bool> expired{false};
+    FrameReader reader;
+    std::string outbound;
+    size_t outboundOffset = 0;
+    int serverDHPublic = 0;
+    HandshakeResult result{};
+};
+
+class HandshakePool {
+public:
+    HandshakePool(int serverPublicKey, int serverModulus, TimerWheel& timers, std::function<void(const HandshakeResult&)> onEstablished)
+        : serverPublicKey(serverPublicKey), serverModulus(serverModulus), timers(timers), onEstablished(std::move(onEstablished)) {
+        for (int i = 0; i < HANDSHAKE_WORKERS; i++) {
+            workers.emplace_back(new Worker(*this));
+        }
+    }
+
+    // Admission control for a freshly accepted socket. Returns false, and
+    // leaves closing the socket to the caller, when the global or per-IP
+    // limit is reached.
+    bool submit(int socket, const sockaddr_in& address) {
+        uint32_t ip = address.sin_addr.s_addr;
+        {
+            std::lock_guard<std::mutex> lock(admissionMutex);
+            if (pending >= MAX_PENDING_HANDSHAKES || perIp[ip] >= MAX_HANDSHAKES_PER_IP) {
+                if (perIp[ip] == 0) {
+                    perIp.erase(ip);
+                }
+                rejected++;
+                return false;
+            }
+            perIp[ip]++;
+            pending++;
+        }
+
+        fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+        std::unique_ptr<PendingHandshake> handshake(new PendingHandshake());
+        handshake->socket = socket;
+        handshake->ip = ip;
+        handshake->outbound = encodeFrame(FRAME_HANDSHAKE, 0, std::to_string(serverPublicKey) + "," + std::to_string(serverModulus));
+        PendingHandshake* expiring = handshake.get();
+        handshake->deadline.callback = [expiring] {
+            expiring->expired = true;
+            shutdown(expiring->socket, SHUT_RDWR);
+        };
+        timers.arm(handshake->deadline, HANDSHAKE_TIMEOUT);
+        workers[nextWorker++ % workers.size()]->add(std::move(handshake));
+        return true;
+    }
+
+    // Handshakes admitted but not yet finished or failed.
+    int queueDepth() const {
+        return pending;
+    }
+
+    void printStats() const {
+        std::cout << "Handshakes pending: " << pending << ", completed: " << completed << ", rejected: " << rejected << ", timed out: " << timedOut << std::endl;
+    }
+
+private:
+    class Worker {
+    public:
+        explicit Worker(HandshakePool& pool) : pool(pool) {
+            epollFd = epoll_create1(0);
+            wakeFd = eventfd(0, EFD_NONBLOCK);
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.fd = wakeFd;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+            std::thread(&Worker::run, this).detach();
+        }
+
+        void add(std::unique_ptr<PendingHandshake> handshake) {
+            {
+                std::lock_guard<std::mutex> lock(incomingMutex);
+                incoming.push_back(std::move(handshake));
+            }
+            uint64_t one = 1;
+            if (write(wakeFd, &one, sizeof(one)) < 0) {
+                // The counter is already non-zero, so the worker will wake anyway.
+            }
+        }
+
+    private:
+        void run() {
+            epoll_event events[64];
+            while (true) {
+                int count = epoll_wait(epollFd, events, 64, -1);
+                for (int i = 0; i < count; i++) {
+                    int fd = events[i].data.fd;
+                    if (fd == wakeFd) {
+                        uint64_t value;
+                        if (read(wakeFd, &value, sizeof(value)) < 0) {
+                            // Nothing to drain.
+                        }
+                        adoptIncoming();
+                        continue;
+                    }
+                    auto it = active.find(fd);
+                    if (it != active.end()) {
+                        step(*it->second, events[i].events);
+                    }
+                }
+            }
+        }
+
+        void adoptIncoming() {
+            std::vector<std::unique_ptr<PendingHandshake>> adopted;
+            {
+                std::lock_guard<std::mutex> lock(incomingMutex);
+                adopted.swap(incoming);
+            }
+            for (auto& handshake : adopted) {
+                int socket = handshake->socket;
+                epoll_event event{};
+                event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                event.data.fd = socket;
+                epoll_ctl(epollFd, EPOLL_CTL_ADD, socket, &event);
+                active[socket] = std::move(handshake);
+            }
+        }
+
+        void step(PendingHandshake& handshake, uint32_t events) {
+            if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                if (!readFrames(handshake)) {
+                    finish(handshake, false);
+                    return;
+                }
+            }
+            if (!flush(handshake)) {
+                finish(handshake, false);
+                return;
+            }
+            if (handshake.state == PendingHandshake::DONE && handshake.outboundOffset == handshake.outbound.size()) {
+                finish(handshake, true);
+            }
+        }
+
+        bool readFrames(PendingHandshake& handshake) {
+            char buffer[1024];
+            while (true) {
+                ssize_t valread = read(handshake.socket, buffer, sizeof(buffer));
+                if (valread == 0) {
+                    return false;
+                }
+                if (valread < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return errno == EAGAIN || errno == EWOULDBLOCK;
+                }
+                handshake.reader.append(buffer, valread);
+
+                Frame frame;
+                bool malformed;
+                while (handshake.reader.next(frame, malformed)) {
+                    if (!handleFrame(handshake, frame)) {
+                        return false;
+                    }
+                }
+                if (malformed) {
+                    return false;
+                }
+            }
+        }
+
+        bool handleFrame(PendingHandshake& handshake, const Frame& frame) {
+            HandshakeResult& result = handshake.result;
+            if (handshake.state == PendingHandshake::AWAIT_CLIENT_RSA && frame.type == FRAME_HANDSHAKE) {
+                if (!parseKeyPair(frame.payload, result.clientPublicKey, result.clientModulus)) {
+                    return false;
+                }
+                std::pair<int, int> PandG = genParameters();
+                auto [pVal, gVal] = PandG;
+                result.pVal = pVal;
+                result.serverDHPrivate = genPrivate(pVal);
+                handshake.serverDHPublic = computePublic(gVal, pVal, result.serverDHPrivate);
+                handshake.outbound += encodeFrame(FRAME_HANDSHAKE, 0, std::to_string(pVal) + "," + std::to_string(gVal));
+                handshake.state = PendingHandshake::AWAIT_CLIENT_DH;
+                return true;
+            }
+            if (handshake.state == PendingHandshake::AWAIT_CLIENT_DH && frame.type == FRAME_HANDSHAKE) {
+                if (!parseKey(frame.payload, result.clientDHpublic)) {
+                    return false;
+                }
+                handshake.outbound += encodeFrame(FRAME_HANDSHAKE, 0, std::to_string(handshake.serverDHPublic));
+                handshake.state = PendingHandshake::AWAIT_OPTIONS;
+                return true;
+            }
+            if (handshake.state == PendingHandshake::AWAIT_OPTIONS && frame.type == FRAME_OPTIONS) {
+                result.compression = hasOption(frame.payload, COMPRESSION_CODEC);
+                result.tracing = hasOption(frame.payload, TRACE_OPTION);
+                result.group = hasOption(frame.payload, GROUP_OPTION);
+                result.heartbeat = hasOption(frame.payload, HEARTBEAT_OPTION);
+                std::string agreed;
+                if (result.compression) {
+                    addOption(agreed, COMPRESSION_CODEC);
+                }
+                if (result.tracing) {
+                    addOption(agreed, TRACE_OPTION);
+                }
+                if (result.group) {
+                    addOption(agreed, GROUP_OPTION);
+                }
+                if (result.heartbeat) {
+                    addOption(agreed, HEARTBEAT_OPTION);
+                }
+                handshake.outbound += encodeFrame(FRAME_OPTIONS, 0, agreed);
+                handshake.state = PendingHandshake::DONE;
+                return true;
+            }
+            // Anything else, including data after the options frame, is a
+            // protocol error.
+            return false;
+        }
+
+        bool flush(PendingHandshake& handshake) {
+            while (handshake.outboundOffset < handshake.outbound.size()) {
+                ssize_t valsent = send(handshake.socket, handshake.outbound.data() + handshake.outboundOffset,
+                                       handshake.outbound.size() - handshake.outboundOffset, MSG_NOSIGNAL);
+                if (valsent < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return errno == EAGAIN || errno == EWOULDBLOCK;
+                }
+                handshake.outboundOffset += valsent;
+            }
+            handshake.outbound.clear();
+            handshake.outboundOffset = 0;
+            return true;
+        }
+
+        void finish(PendingHandshake& handshake, bool established) {
+            pool.timers.cancel(handshake.deadline);
+            if (handshake.expired) {
+                // The socket is already shut down, whatever state it reached.
+                pool.timedOut++;
+                established = false;
+            }
+            int socket = handshake.socket;
+            uint32_t ip = handshake.ip;
+            HandshakeResult result = handshake.result;
+            result.socket = socket;
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, socket, nullptr);
+            active.erase(socket);
+
+            pool.release(ip);
+            if (established) {
+                pool.completed++;
+                fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) & ~O_NONBLOCK);
+                pool.onEstablished(result);
+            }
+            else {
+                close(socket);
+            }
+        }
+
+        HandshakePool& pool;
+        int epollFd;
+        int wakeFd;
+        std::mutex incomingMutex;
+        std::vector<std::unique_ptr<PendingHandshake>> incoming;
+        std::unordered_map<int, std::unique_ptr<PendingHandshake>> active;
+    };
+
+    void release(uint32_t ip) {
+        std::lock_guard<std::mutex> lock(admissionMutex);
+        if (--perIp[ip] == 0) {
+            perIp.erase(ip);
+        }
+        pending--;
+    }
+
+    int serverPublicKey;
+    int serverModulus;
+    TimerWheel& timers;
+    std::function<void(const HandshakeResult&)> onEstablished;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<unsigned> nextWorker{0};
+
+    std::mutex admissionMutex;
+    std::unordered_map<uint32_t, int> perIp;
+    std::atomic<int> pending{0};
+    std::atomic<long> completed{0};
+    std::atomic<long> rejected{0};
+    std::atomic<long> timedOut{0};
+};
@@ -0,0 +1,174 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "Framing.cpp"
+
+// Reference counted message buffers carved out of slabs. Buffers come in a
+// few fixed size classes, each with its own free list, so once the server
+// has warmed up a broadcast takes buffers from the free lists instead of
+// calling malloc for every recipient, and RSS stays flat under load.
+
+const size_t MESSAGE_SIZE_CLASSES[] = {512, 4096, 32 * 1024, FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD};
+const int MESSAGE_CLASS_COUNT = sizeof(MESSAGE_SIZE_CLASSES) / sizeof(MESSAGE_SIZE_CLASSES[0]);
+
+// Each slab is about this big, so small classes get many buffers per slab.
+const size_t MESSAGE_SLAB_BYTES = 256 * 1024;
+
+struct MessageBlock {
+    std::atomic<int> refs;
+    int sizeClass;
+    size_t length;
+    MessageBlock* nextFree;
+    char* data;
+};
+
+class MessagePool {
+public:
+    static MessagePool& instance() {
+        static MessagePool pool;
+        return pool;
+    }
+
+    // Returns a block of at least capacity bytes, or nullptr if capacity is
+    // larger than the biggest class.
+    MessageBlock* acquire(size_t capacity) {
+        int sizeClass = 0;
+        while (sizeClass < MESSAGE_CLASS_COUNT && MESSAGE_SIZE_CLASSES[sizeClass] < capacity) {
+            sizeClass++;
+        }
+        if (sizeClass == MESSAGE_CLASS_COUNT) {
+            return nullptr;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (freeLists[sizeClass] == nullptr) {
+            addSlab(sizeClass);
+        }
+        MessageBlock* block = freeLists[sizeClass];
+        freeLists[sizeClass] = block->nextFree;
+        block->refs = 1;
+        block->length = 0;
+        bytesInUse += MESSAGE_SIZE_CLASSES[sizeClass];
+        return block;
+    }
+
+    void release(MessageBlock* block) {
+        std::lock_guard<std::mutex> lock(mutex);
+        block->nextFree = freeLists[block->sizeClass];
+        freeLists[block->sizeClass] = block;
+        bytesInUse -= MESSAGE_SIZE_CLASSES[block->sizeClass];
+    }
+
+    size_t inUseBytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return bytesInUse;
+    }
+
+    size_t reservedBytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return bytesReserved;
+    }
+
+private:
+    MessagePool() {
+        for (int i = 0; i < MESSAGE_CLASS_COUNT; i++) {
+            freeLists[i] = nullptr;
+        }
+    }
+
+    void addSlab(int sizeClass) {
+        size_t blockSize = MESSAGE_SIZE_CLASSES[sizeClass];
+        size_t count = std::max<size_t>(1, MESSAGE_SLAB_BYTES / blockSize);
+        slabs.emplace_back(new char[blockSize * count]);
+        blockSlabs.emplace_back(new MessageBlock[count]);
+        char* memory = slabs.back().get();
+        MessageBlock* blocks = blockSlabs.back().get();
+        for (size_t i = 0; i < count; i++) {
+            blocks[i].sizeClass = sizeClass;
+            blocks[i].data = memory + i * blockSize;
+            blocks[i].nextFree = freeLists[sizeClass];
+            freeLists[sizeClass] = &blocks[i];
+        }
+        bytesReserved += blockSize * count;
+    }
+
+    std::mutex mutex;
+    MessageBlock* freeLists[MESSAGE_CLASS_COUNT];
+    std::vector<std::unique_ptr<char[]>> slabs;
+    std::vector<std::unique_ptr<MessageBlock[]>> blockSlabs;
+    size_t bytesInUse = 0;
+    size_t bytesReserved = 0;
+};
+
+// Shared handle to a pooled block. Copies share the bytes; the block goes
+// back to its free list when the last handle is dropped.
+class MessageRef {
+public:
+    MessageRef() : block(nullptr) {}
+
+    static MessageRef allocate(size_t capacity) {
+        MessageRef ref;
+        ref.block = MessagePool::instance().acquire(capacity);
+        return ref;
+    }
+
+    MessageRef(const MessageRef& other) : block(other.block) {
+        if (block != nullptr) {
+            block->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    MessageRef(MessageRef&& other) noexcept : block(other.block) {
+        other.block = nullptr;
+    }
+
+    MessageRef& operator=(MessageRef other) {
+        std::swap(block, other.block);
+        return *this;
+    }
+
+    ~MessageRef() {
+        if (block != nullptr && block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            MessagePool::instance().release(block);
+        }
+    }
+
+    explicit operator bool() const {
+        return block != nullptr;
+    }
+
+    char* data() {
+        return block->data;
+    }
+
+    const char* data() const {
+        return block->data;
+    }
+
+    size_t size() const {
+        return block->length;
+    }
+
+    void setSize(size_t length) {
+        block->length = length;
+    }
+
+    size_t capacity() const {
+        return MESSAGE_SIZE_CLASSES[block->sizeClass];
+    }
+
+    // Whether this is the only handle, so the bytes may be changed without
+    // racing readers of other handles.
+    bool unique() const {
+        return block->refs.load(std::memory_order_acquire) == 1;
+    }
+
+private:
+    MessageBlock* block;
+};
@@ -0,0 +1,237 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <immintrin.h>
+
+// Batch modular exponentiation for RSA. Every block of a message is raised
+// to the same exponent, so the square-and-multiply steps line up and 8
+// (AVX2) or 16 (AVX-512) blocks can run in lockstep, one per SIMD lane.
+// Our moduli are products of two small primes, so each lane works on 32 bit
+// integers and reduces with a float estimate of the quotient that is then
+// corrected exactly.
+//
+// A broadcast encrypts the same message under every recipient's key. The
+// multi-key kernels give each lane its own exponent and modulus, looked up
+// from small per-recipient tables, so the blocks of many recipients share
+// one pass and short chat messages still fill every lane.
+
+// Largest modulus the SIMD kernels accept: products stay below 2^30, which
+// keeps the quotient estimate within a couple of units of the real one.
+const int BATCH_MAX_MODULUS = 1 << 15;
+
+inline int modExpOne(int base, int exponent, int modulus) {
+    int result = 1;
+    while (exponent > 0) {
+        if (exponent % 2 == 1)
+            result = (result * base) % modulus;
+        exponent = exponent >> 1;
+        base = (base * base) % modulus;
+    }
+    return result;
+}
+
+inline size_t modExpBatchScalar(const int* bases, int* results, size_t count, int exponent, int modulus) {
+    for (size_t i = 0; i < count; i++) {
+        results[i] = modExpOne(bases[i], exponent, modulus);
+    }
+    return count;
+}
+
+__attribute__((target("avx2")))
+inline __m256i mulModAVX2(__m256i a, __m256i b, __m256i n, __m256 invN) {
+    __m256i product = _mm256_mullo_epi32(a, b);
+    __m256i quotient = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(product), invN));
+    __m256i r = _mm256_sub_epi32(product, _mm256_mullo_epi32(quotient, n));
+    __m256i zero = _mm256_setzero_si256();
+    __m256i nMinusOne = _mm256_sub_epi32(n, _mm256_set1_epi32(1));
+    for (int fix = 0; fix < 2; fix++) {
+        r = _mm256_add_epi32(r, _mm256_and_si256(_mm256_cmpgt_epi32(zero, r), n));
+        r = _mm256_sub_epi32(r, _mm256_and_si256(_mm256_cmpgt_epi32(r, nMinusOne), n));
+    }
+    return r;
+}
+
+__attribute__((target("avx2")))
+inline size_t modExpBatchAVX2(const int* bases, int* results, size_t count, int exponent, int modulus) {
+    const __m256i n = _mm256_set1_epi32(modulus);
+    const __m256 invN = _mm256_set1_ps(1.0f / modulus);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i base = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bases + i));
+        __m256i result = _mm256_set1_epi32(1);
+        for (int e = exponent; e > 0; e >>= 1) {
+            if (e & 1)
+                result = mulModAVX2(result, base, n, invN);
+            base = mulModAVX2(base, base, n, invN);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(results + i), result);
+    }
+    return i;
+}
+
+__attribute__((target("avx512f")))
+inline __m512i mulModAVX512(__m512i a, __m512i b, __m512i n, __m512 invN) {
+    __m512i product = _mm512_mullo_epi32(a, b);
+    __m512i quotient = _mm512_cvttps_epi32(_mm512_mul_ps(_mm512_cvtepi32_ps(product), invN));
+    __m512i r = _mm512_sub_epi32(product, _mm512_mullo_epi32(quotient, n));
+    __m512i zero = _mm512_setzero_si512();
+    for (int fix = 0; fix < 2; fix++) {
+        r = _mm512_mask_add_epi32(r, _mm512_cmplt_epi32_mask(r, zero), r, n);
+        r = _mm512_mask_sub_epi32(r, _mm512_cmpge_epi32_mask(r, n), r, n);
+    }
+    return r;
+}
+
+__attribute__((target("avx512f")))
+inline size_t modExpBatchAVX512(const int* bases, int* results, size_t count, int exponent, int modulus) {
+    const __m512i n = _mm512_set1_epi32(modulus);
+    const __m512 invN = _mm512_set1_ps(1.0f / modulus);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512i base = _mm512_loadu_si512(bases + i);
+        __m512i result = _mm512_set1_epi32(1);
+        for (int e = exponent; e > 0; e >>= 1) {
+            if (e & 1)
+                result = mulModAVX512(result, base, n, invN);
+            base = mulModAVX512(base, base, n, invN);
+        }
+        _mm512_storeu_si512(results + i, result);
+    }
+    return i;
+}
+
+typedef size_t (*ModExpKernel)(const int*, int*, size_t, int, int);
+
+// Picks the widest kernel this CPU supports, once.
+inline ModExpKernel modExpKernel() {
+    static const ModExpKernel kernel = [] {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            return &modExpBatchAVX512;
+        if (__builtin_cpu_supports("avx2"))
+            return &modExpBatchAVX2;
+        return &modExpBatchScalar;
+    }();
+    return kernel;
+}
+
+// Raises every block to exponent mod modulus in place. Blocks are first
+// reduced into [0, modulus) so every kernel sees the same input.
+inline void modExpBatch(std::vector<int>& blocks, int exponent, int modulus) {
+    if (modulus <= 1) {
+        std::fill(blocks.begin(), blocks.end(), 0);
+        return;
+    }
+    for (int& block : blocks) {
+        block %= modulus;
+        if (block < 0)
+            block += modulus;
+    }
+
+    size_t done = 0;
+    if (modulus < BATCH_MAX_MODULUS) {
+        done = modExpKernel()(blocks.data(), blocks.data(), blocks.size(), exponent, modulus);
+    }
+    modExpBatchScalar(blocks.data() + done, blocks.data() + done, blocks.size() - done, exponent, modulus);
+}
+
+inline size_t modExpMultiKeyScalar(const int* bases, const uint8_t* keys, const int* exponents, const int* moduli, int* results, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        int modulus = moduli[keys[i]];
+        results[i] = modulus <= 1 ? 0 : modExpOne(bases[i], exponents[keys[i]], modulus);
+    }
+    return count;
+}
+
+// Each lane gathers its exponent and modulus from the key tables, and stops
+// multiplying once its own exponent runs out; the loop runs for the longest
+// exponent in the vector.
+__attribute__((target("avx2")))
+inline size_t modExpMultiKeyAVX2(const int* bases, const uint8_t* keys, const int* exponents, const int* moduli, int* results, size_t count) {
+    const __m256i one = _mm256_set1_epi32(1);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i key = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(keys + i)));
+        __m256i n = _mm256_i32gather_epi32(moduli, key, 4);
+        __m256 invN = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_cvtepi32_ps(n));
+        __m256i e = _mm256_i32gather_epi32(exponents, key, 4);
+        __m256i base = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bases + i));
+        __m256i result = one;
+        while (!_mm256_testz_si256(e, e)) {
+            __m256i odd = _mm256_cmpeq_epi32(_mm256_and_si256(e, one), one);
+            result = _mm256_blendv_epi8(result, mulModAVX2(result, base, n, invN), odd);
+            base = mulModAVX2(base, base, n, invN);
+            e = _mm256_srli_epi32(e, 1);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(results + i), result);
+    }
+    return i;
+}
+
+__attribute__((target("avx512f")))
+inline size_t modExpMultiKeyAVX512(const int* bases, const uint8_t* keys, const int* exponents, const int* moduli, int* results, size_t count) {
+    const __m512i one = _mm512_set1_epi32(1);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512i key = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i)));
+        __m512i n = _mm512_i32gather_epi32(key, moduli, 4);
+        __m512 invN = _mm512_div_ps(_mm512_set1_ps(1.0f), _mm512_cvtepi32_ps(n));
+        __m512i e = _mm512_i32gather_epi32(key, exponents, 4);
+        __m512i base = _mm512_loadu_si512(bases + i);
+        __m512i result = one;
+        while (_mm512_test_epi32_mask(e, e) != 0) {
+            __mmask16 odd = _mm512_test_epi32_mask(e, one);
+            result = _mm512_mask_mov_epi32(result, odd, mulModAVX512(result, base, n, invN));
+            base = mulModAVX512(base, base, n, invN);
+            e = _mm512_srli_epi32(e, 1);
+        }
+        _mm512_storeu_si512(results + i, result);
+    }
+    return i;
+}
+
+typedef size_t (*MultiKeyKernel)(const int*, const uint8_t*, const int*, const int*, int*, size_t);
+
+inline MultiKeyKernel multiKeyKernel() {
+    static const MultiKeyKernel kernel = [] {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            return &modExpMultiKeyAVX512;
+        if (__builtin_cpu_supports("avx2"))
+            return &modExpMultiKeyAVX2;
+        return &modExpMultiKeyScalar;
+    }();
+    return kernel;
+}
+
+// Most keys one multi-key pass can tell apart, as each block names its key
+// in one byte.
+const size_t MULTI_KEY_MAX_KEYS = 256;
+
+// Raises blocks[i] to exponents[keys[i]] mod moduli[keys[i]] in place. The
+// key tables hold keyCount entries, at most MULTI_KEY_MAX_KEYS.
+inline void modExpMultiKey(int* blocks, const uint8_t* keys, size_t count, const int* exponents, const int* moduli, size_t keyCount) {
+    bool vectorizable = true;
+    for (size_t k = 0; k < keyCount; k++) {
+        if (moduli[k] <= 1 || moduli[k] >= BATCH_MAX_MODULUS) {
+            vectorizable = false;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        int modulus = moduli[keys[i]];
+        if (modulus > 1) {
+            blocks[i] %= modulus;
+            if (blocks[i] < 0)
+                blocks[i] += modulus;
+        }
+    }
+
+    size_t done = 0;
+    if (vectorizable) {
+        done = multiKeyKernel()(blocks, keys, exponents, moduli, blocks, count);
+    }
+    modExpMultiKeyScalar(blocks + done, keys + done, exponents, moduli, blocks + done, count - done);
+}
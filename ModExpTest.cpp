@@ -0,0 +1,111 @@
+#include <iostream>
+#include <random>
+#include <vector>
+#include "ModExpBatch.cpp"
+
+// Checks every modExpBatch and modExpMultiKey kernel this CPU supports
+// against modExpOne, for every modulus below 400 and every byte value.
+
+const int TEST_MAX_MODULUS = 400;
+const int TEST_EXPONENTS[] = {0, 1, 2, 3, 7, 16, 17, 255, 1021, 65537};
+
+long checkBatch(const char* name, ModExpKernel kernel) {
+    long mismatches = 0;
+    std::vector<int> bases(256), results(256);
+    for (int modulus = 2; modulus < TEST_MAX_MODULUS; modulus++) {
+        for (int exponent : TEST_EXPONENTS) {
+            for (int base = 0; base < 256; base++) {
+                bases[base] = base % modulus;
+            }
+            size_t done = kernel(bases.data(), results.data(), bases.size(), exponent, modulus);
+            for (size_t i = 0; i < done; i++) {
+                if (results[i] != modExpOne(bases[i], exponent, modulus)) {
+                    mismatches++;
+                }
+            }
+        }
+    }
+    std::cout << name << ": " << mismatches << " mismatches" << std::endl;
+    return mismatches;
+}
+
+long checkMultiKey(const char* name, MultiKeyKernel kernel) {
+    long mismatches = 0;
+    std::mt19937 gen(1);
+    std::vector<int> exponents(MULTI_KEY_MAX_KEYS), moduli(MULTI_KEY_MAX_KEYS);
+    std::vector<int> bases(4096), results(4096);
+    std::vector<uint8_t> keys(4096);
+    for (int round = 0; round < 200; round++) {
+        for (size_t k = 0; k < MULTI_KEY_MAX_KEYS; k++) {
+            moduli[k] = 2 + gen() % (TEST_MAX_MODULUS - 2);
+            exponents[k] = TEST_EXPONENTS[gen() % (sizeof(TEST_EXPONENTS) / sizeof(int))];
+        }
+        for (size_t i = 0; i < bases.size(); i++) {
+            keys[i] = gen() % MULTI_KEY_MAX_KEYS;
+            bases[i] = (gen() % 256) % moduli[keys[i]];
+        }
+        size_t done = kernel(bases.data(), keys.data(), exponents.data(), moduli.data(), results.data(), bases.size());
+        for (size_t i = 0; i < done; i++) {
+            if (results[i] != modExpOne(bases[i], exponents[keys[i]], moduli[keys[i]])) {
+                mismatches++;
+            }
+        }
+    }
+    std::cout << name << ": " << mismatches << " mismatches" << std::endl;
+    return mismatches;
+}
+
+// The public entry points, with unreduced and negative input.
+long checkEntryPoints() {
+    long mismatches = 0;
+    for (int modulus = 2; modulus < TEST_MAX_MODULUS; modulus++) {
+        std::vector<int> blocks;
+        for (int base = -255; base < 256; base++) {
+            blocks.push_back(base);
+        }
+        std::vector<int> batch = blocks;
+        modExpBatch(batch, 17, modulus);
+        std::vector<uint8_t> keys(blocks.size());
+        int exponents[2] = {17, 5};
+        int moduli[2] = {modulus, TEST_MAX_MODULUS - modulus + 2};
+        for (size_t i = 0; i < keys.size(); i++) {
+            keys[i] = i % 2;
+        }
+        std::vector<int> multi = blocks;
+        modExpMultiKey(multi.data(), keys.data(), multi.size(), exponents, moduli, 2);
+        for (size_t i = 0; i < blocks.size(); i++) {
+            int reduced = ((blocks[i] % modulus) + modulus) % modulus;
+            if (batch[i] != modExpOne(reduced, 17, modulus)) {
+                mismatches++;
+            }
+            int keyModulus = moduli[keys[i]];
+            reduced = ((blocks[i] % keyModulus) + keyModulus) % keyModulus;
+            if (multi[i] != modExpOne(reduced, exponents[keys[i]], keyModulus)) {
+                mismatches++;
+            }
+        }
+    }
+    std::cout << "modExpBatch and modExpMultiKey: " << mismatches << " mismatches" << std::endl;
+    return mismatches;
+}
+
+int main() {
+    __builtin_cpu_init();
+    bool avx2 = __builtin_cpu_supports("avx2");
+    bool avx512 = __builtin_cpu_supports("avx512f");
+    std::cout << "AVX2: " << (avx2 ? "yes" : "no") << ", AVX-512: " << (avx512 ? "yes" : "no") << std::endl;
+
+    long mismatches = checkBatch("scalar", &modExpBatchScalar);
+    mismatches += checkMultiKey("multi-key scalar", &modExpMultiKeyScalar);
+    if (avx2) {
+        mismatches += checkBatch("AVX2", &modExpBatchAVX2);
+        mismatches += checkMultiKey("multi-key AVX2", &modExpMultiKeyAVX2);
+    }
+    if (avx512) {
+        mismatches += checkBatch("AVX-512", &modExpBatchAVX512);
+        mismatches += checkMultiKey("multi-key AVX-512", &modExpMultiKeyAVX512);
+    }
+    mismatches += checkEntryPoints();
+
+    return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <random>
+
+// Toy RSA key generation shared by the server and the client.
+
+inline bool isPrime(int n) {
+    if (n <= 1) return false;
+    if (n <= 3) return true;
+    if (n % 2 == 0 || n % 3 == 0) return false;
+    for (int i = 5; i * i <= n; i += 6) {
+        if (n % i == 0 || n % (i + 2) == 0) return false;
+    }
+    return true;
+}
+
+inline int generateRandomPrime(int min, int max) {
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_int_distribution<int> dist(min, max);
+    int candidate = dist(gen);
+    while (!isPrime(candidate)) {
+        candidate = dist(gen);
+    }
+    return candidate;
+}
+
+inline int gcd(int a, int b) {
+    if (b == 0) return a;
+    return gcd(b, a % b);
+}
+
+inline int modInverse(int a, int m) {
+    a = a % m;
+    for (int x = 1; x < m; x++) {
+        if ((a * x) % m == 1) return x;
+    }
+    return -1;
+}
+
+inline void generateKeys(int p, int q, int &n, int &e, int &d) {
+    n = p * q;
+    int phi = (p - 1) * (q - 1);
+
+    for (e = 2; e < phi; e++) {
+        if (gcd(e, phi) == 1)
+            break;
+    }
+
+    d = modInverse(e, phi);
+}
+
+// n = p * q must exceed 255 so every byte value survives RSA. p and q must
+// differ too, or phi is wrong and decryption fails.
+inline void generateKeyPair(int& n, int& e, int& d) {
+    int p = generateRandomPrime(17,100);
+    int q = generateRandomPrime(17,100);
+    while (q == p) {
+        q = generateRandomPrime(17,100);
+    }
+    generateKeys(p, q, n, e, d);
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// Token buckets for rate limiting senders. A bucket holds up to burst
+// tokens and refills at rate tokens per second. Instead of a token count
+// it keeps the time at which it would be full again, so refilling needs
+// no background work and taking tokens is one compare and swap, safe from
+// any number of threads without a lock.
+
+// How long a delayed message may be held before it is rejected instead.
+const uint64_t RATE_LIMIT_MAX_DELAY_NS = 1000000000ull;
+
+class TokenBucket {
+public:
+    // A rate of 0 leaves the bucket unlimited.
+    TokenBucket(double rate = 0, double burst = 0) {
+        configure(rate, burst);
+    }
+
+    // Not safe while other threads take tokens.
+    void configure(double rate, double burst) {
+        nanosPerToken = rate > 0 ? 1e9 / rate : 0;
+        capacity = static_cast<uint64_t>((burst > 1 ? burst : 1) * nanosPerToken);
+        fullAt.store(0, std::memory_order_relaxed);
+    }
+
+    bool unlimited() const {
+        return nanosPerToken == 0;
+    }
+
+    // Takes cost tokens at time now, in CLOCK_MONOTONIC nanoseconds. When
+    // the bucket is short, the tokens are still taken if they will have
+    // refilled within maxDelay, and delay is set to how long the caller
+    // must wait before going ahead. Otherwise nothing is taken, delay is
+    // set to how long until it would succeed and false is returned.
+    bool take(double cost, uint64_t now, uint64_t maxDelay, uint64_t& delay) {
+        delay = 0;
+        if (unlimited()) {
+            return true;
+        }
+        uint64_t needed = static_cast<uint64_t>(cost * nanosPerToken);
+        uint64_t current = fullAt.load(std::memory_order_relaxed);
+        while (true) {
+            // A bucket that filled up in the past is simply full now.
+            uint64_t next = (current > now ? current : now) + needed;
+            delay = next - now > capacity ? next - now - capacity : 0;
+            if (delay > maxDelay) {
+                return false;
+            }
+            if (fullAt.compare_exchange_weak(current, next, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+    }
+
+    // Returns tokens taken by an earlier take().
+    void refund(double cost) {
+        if (!unlimited()) {
+            fullAt.fetch_sub(static_cast<uint64_t>(cost * nanosPerToken), std::memory_order_relaxed);
+        }
+    }
+
+private:
+    double nanosPerToken = 0;
+    uint64_t capacity = 0;
+    std::atomic<uint64_t> fullAt{0};
+};
+
+// A message limit and a byte limit that apply together.
+struct RateLimiter {
+    TokenBucket messages;
+    TokenBucket bytes;
+
+    // Takes from both buckets or, returning false, from neither. delay is
+    // the longer of the two waits.
+    bool take(double messageCost, double byteCost, uint64_t now, uint64_t maxDelay, uint64_t& delay) {
+        uint64_t byteDelay;
+        if (!messages.take(messageCost, now, maxDelay, delay)) {
+            return false;
+        }
+        if (!bytes.take(byteCost, now, maxDelay, byteDelay)) {
+            messages.refund(messageCost);
+            delay = byteDelay;
+            return false;
+        }
+        delay = delay > byteDelay ? delay : byteDelay;
+        return true;
+    }
+
+    void refund(double messageCost, double byteCost) {
+        messages.refund(messageCost);
+        bytes.refund(byteCost);
+    }
+};
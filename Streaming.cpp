@@ -0,0 +1,162 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include "MessagePool.cpp"
+#include "Tracing.cpp"
+
+// Large payloads are cut into chunks of this many plaintext bytes, each
+// encrypted and framed on its own.
+const size_t STREAM_CHUNK_SIZE = 4096;
+
+// Number of encrypted chunks a single transfer may have queued for sending.
+// Together with STREAM_CHUNK_SIZE this bounds the memory one transfer uses.
+const size_t STREAM_WINDOW = 8;
+
+// Chat frames queued for one socket may hold at most this much pooled
+// memory; past it, new chat frames for that socket are dropped.
+const size_t MAX_QUEUED_CHAT_BYTES = 1024 * 1024;
+
+// Outbound frames for one socket. A dedicated writer thread drains chat
+// frames before stream chunks, so a file share never holds up chat. Stream
+// chunks are refused once their stream has a given number queued, so a
+// producer never waits on a slow reader and memory per stream stays bounded.
+class SendQueue {
+public:
+    explicit SendQueue(int socket) : socket(socket), writer(&SendQueue::writerLoop, this) {}
+
+    ~SendQueue() {
+        close();
+    }
+
+    // Returns false when the queue is closed or over MAX_QUEUED_CHAT_BYTES.
+    // A mark with a trace id records a span covering queueing and sending.
+    bool pushChat(MessageRef frame, TraceMark mark = TraceMark()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (closed || queuedChatBytes + frame.capacity() > MAX_QUEUED_CHAT_BYTES) {
+            return false;
+        }
+        queuedChatBytes += frame.capacity();
+        queuedBytes += frame.capacity();
+        chatFrames.emplace_back(std::move(frame), mark);
+        ready.notify_one();
+        return true;
+    }
+
+    // Returns false when the queue is closed or already holds limit frames
+    // of streamId.
+    bool pushBulk(uint32_t streamId, MessageRef frame, size_t limit) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto queued = inFlight.find(streamId);
+        if (closed || (queued != inFlight.end() && queued->second >= limit)) {
+            return false;
+        }
+        inFlight[streamId]++;
+        queuedBytes += frame.capacity();
+        bulkFrames.emplace_back(streamId, std::move(frame));
+        ready.notify_one();
+        return true;
+    }
+
+    // Pooled bytes held by frames waiting to be sent on this socket.
+    size_t memoryUsed() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queuedBytes;
+    }
+
+    // Stops accepting frames, sends what is already queued and joins the writer.
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        ready.notify_all();
+        if (writer.joinable() && writer.get_id() != std::this_thread::get_id()) {
+            writer.join();
+        }
+    }
+
+private:
+    void writerLoop() {
+        while (true) {
+            MessageRef frame;
+            TraceMark mark;
+            uint32_t streamId = 0;
+            bool bulk = false;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [&] { return closed || !chatFrames.empty() || !bulkFrames.empty(); });
+                if (!chatFrames.empty()) {
+                    frame = std::move(chatFrames.front().first);
+                    mark = chatFrames.front().second;
+                    chatFrames.pop_front();
+                }
+                else if (!bulkFrames.empty()) {
+                    streamId = bulkFrames.front().first;
+                    frame = std::move(bulkFrames.front().second);
+                    bulkFrames.pop_front();
+                    bulk = true;
+                }
+                else {
+                    return;
+                }
+            }
+
+            // A frame shared with other queues keeps the send time it was
+            // built with, as other writers may be sending it right now.
+            if ((frame.data()[1] & FRAME_FLAG_TRACED) && frame.unique()) {
+                stampTraceTime(frame.data(), traceNow());
+            }
+            bool sent = writeFully(socket, frame.data(), frame.size());
+            if (mark.traceId != 0) {
+                recordSpan("server.send", mark.traceId, mark.start, traceNow(), socket);
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (bulk && --inFlight[streamId] == 0) {
+                inFlight.erase(streamId);
+            }
+            if (!bulk) {
+                queuedChatBytes -= frame.capacity();
+            }
+            queuedBytes -= frame.capacity();
+            if (!sent) {
+                closed = true;
+                chatFrames.clear();
+                bulkFrames.clear();
+                inFlight.clear();
+                queuedChatBytes = 0;
+                queuedBytes = 0;
+            }
+            if (!sent) {
+                return;
+            }
+        }
+    }
+
+    int socket;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::pair<MessageRef, TraceMark>> chatFrames;
+    std::deque<std::pair<uint32_t, MessageRef>> bulkFrames;
+    std::map<uint32_t, size_t> inFlight;
+    size_t queuedChatBytes = 0;
+    size_t queuedBytes = 0;
+    bool closed = false;
+    std::thread writer;
+};
+
+// Splits a stream name from any directory part so received files always
+// land in the working directory.
+inline std::string streamFileName(const std::string& name) {
+    size_t slash = name.find_last_of('/');
+    std::string base = slash == std::string::npos ? name : name.substr(slash + 1);
+    if (base.empty() || base == "." || base == "..") {
+        return "file";
+    }
+    return base;
+}
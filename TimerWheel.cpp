@@ -0,0 +1,175 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Hierarchical timer wheel. Timers live in intrusive doubly linked lists, one
+// per slot, so arming and cancelling are O(1) however many timers exist.
+// Level 0 has one slot per tick; each higher level has slots 64 times as
+// wide, and its timers cascade down a level as their time comes closer.
+
+const int TIMER_LEVEL_BITS = 6;
+const int TIMER_SLOTS = 1 << TIMER_LEVEL_BITS;
+const int TIMER_LEVELS = 4;
+
+// With 10ms ticks the wheel reaches about 46 hours; longer delays are clamped.
+const std::chrono::milliseconds TIMER_TICK(10);
+
+struct TimerNode {
+    TimerNode* prev = nullptr;
+    TimerNode* next = nullptr;
+    uint64_t expires = 0;
+    // Runs on the thread that advances the wheel, without the wheel locked,
+    // so it may arm timers, including its own node.
+    std::function<void()> callback;
+};
+
+class TimerWheel {
+public:
+    explicit TimerWheel(std::chrono::milliseconds tick = TIMER_TICK) : tick(tick), started(std::chrono::steady_clock::now()) {
+        for (int level = 0; level < TIMER_LEVELS; level++) {
+            for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+                TimerNode& head = slots[level][slot];
+                head.prev = head.next = &head;
+            }
+        }
+        expired.prev = expired.next = &expired;
+    }
+
+    // Fires node's callback after delay, replacing any earlier arming.
+    void arm(TimerNode& node, std::chrono::milliseconds delay) {
+        uint64_t now = (std::chrono::steady_clock::now() - started) / tick;
+        std::lock_guard<std::mutex> lock(mutex);
+        unlink(node);
+        // Count from the clock, as currentTick lags it while the advancing
+        // thread is busy, and add one tick for the part of this one that
+        // has already gone, so the timer never fires early.
+        uint64_t ticks = (delay.count() + tick.count() - 1) / tick.count();
+        node.expires = std::max(now, currentTick) + ticks + 1;
+        insert(node);
+        armed++;
+    }
+
+    // Disarms node. If its callback is running, waits for it to return, so
+    // the node may be destroyed afterwards.
+    void cancel(TimerNode& node) {
+        std::unique_lock<std::mutex> lock(mutex);
+        callbackDone.wait(lock, [&] { return running != &node; });
+        if (node.prev != nullptr) {
+            unlink(node);
+        }
+    }
+
+    size_t armedCount() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return armed;
+    }
+
+    // Runs every timer that is due.
+    void advance() {
+        uint64_t target = (std::chrono::steady_clock::now() - started) / tick;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (currentTick < target) {
+            step();
+            while (expired.next != &expired) {
+                TimerNode* node = expired.next;
+                unlink(*node);
+                running = node;
+                lock.unlock();
+                node->callback();
+                lock.lock();
+                running = nullptr;
+                callbackDone.notify_all();
+            }
+        }
+    }
+
+    // Advances the wheel once a tick until stop() is called.
+    void run() {
+        while (!stopped.load(std::memory_order_relaxed)) {
+            std::this_thread::sleep_for(tick);
+            advance();
+        }
+    }
+
+    // Makes run() return after its current tick. Join the thread running it
+    // before the wheel goes away.
+    void stop() {
+        stopped.store(true, std::memory_order_relaxed);
+    }
+
+private:
+    void insert(TimerNode& node) {
+        uint64_t delta = node.expires - currentTick;
+        uint64_t maxDelta = (1ull << (TIMER_LEVEL_BITS * TIMER_LEVELS)) - 1;
+        if (delta > maxDelta) {
+            node.expires = currentTick + maxDelta;
+            delta = maxDelta;
+        }
+        int level = 0;
+        while (delta >= (1ull << (TIMER_LEVEL_BITS * (level + 1)))) {
+            level++;
+        }
+        TimerNode& head = slots[level][(node.expires >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1)];
+        node.prev = &head;
+        node.next = head.next;
+        head.next->prev = &node;
+        head.next = &node;
+    }
+
+    void unlink(TimerNode& node) {
+        if (node.prev == nullptr) {
+            return;
+        }
+        node.prev->next = node.next;
+        node.next->prev = node.prev;
+        node.prev = node.next = nullptr;
+        armed--;
+    }
+
+    // Moves one tick forward: cascades higher levels whose slot just came
+    // round, then queues the due level 0 slot on the expired list.
+    void step() {
+        currentTick++;
+        for (int level = 1; level < TIMER_LEVELS; level++) {
+            if ((currentTick & ((1ull << (TIMER_LEVEL_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            TimerNode& head = slots[level][(currentTick >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1)];
+            while (head.next != &head) {
+                TimerNode* node = head.next;
+                unlink(*node);
+                insert(*node);
+                armed++;
+            }
+        }
+
+        TimerNode& due = slots[0][currentTick & (TIMER_SLOTS - 1)];
+        while (due.next != &due) {
+            TimerNode* node = due.next;
+            unlink(*node);
+            node->prev = expired.prev;
+            node->next = &expired;
+            expired.prev->next = node;
+            expired.prev = node;
+            armed++;
+        }
+    }
+
+    std::chrono::milliseconds tick;
+    std::chrono::steady_clock::time_point started;
+    std::mutex mutex;
+    std::condition_variable callbackDone;
+    TimerNode slots[TIMER_LEVELS][TIMER_SLOTS];
+    // Due timers waiting for their callback; still count as armed.
+    TimerNode expired;
+    TimerNode* running = nullptr;
+    uint64_t currentTick = 0;
+    size_t armed = 0;
+    std::atomic<bool> stopped{false};
+};
@@ -0,0 +1,103 @@
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+#include "TimerWheel.cpp"
+
+// Checks that TimerWheel fires every armed timer once and never early, that
+// cancelled timers stay quiet, that delays long enough to start on the
+// second and third levels cascade down correctly, and that cancel() waits
+// for a running callback.
+
+const std::chrono::milliseconds TEST_TICK(1);
+const int TEST_TIMERS = 20000;
+// With 1ms ticks, 5s reaches the third level of the wheel.
+const int TEST_MAX_DELAY_MS = 5000;
+
+struct TestTimer {
+    TimerNode node;
+    std::chrono::steady_clock::time_point due;
+    std::atomic<int> fired{0};
+    std::atomic<bool> early{false};
+    bool cancelled = false;
+};
+
+int main() {
+    TimerWheel wheel(TEST_TICK);
+
+    std::mt19937 gen(1);
+    std::vector<std::unique_ptr<TestTimer>> timers;
+    for (int i = 0; i < TEST_TIMERS; i++) {
+        std::unique_ptr<TestTimer> timer(new TestTimer());
+        TestTimer* raw = timer.get();
+        // A share of delays on every level. Every tenth timer is re-armed
+        // or cancelled below, so it must not be due before then.
+        int level = gen() % 3;
+        int limit = level == 0 ? 64 : level == 1 ? 4096 : TEST_MAX_DELAY_MS;
+        std::chrono::milliseconds delay(i % 10 == 0 ? 1000 + gen() % (TEST_MAX_DELAY_MS - 1000) : gen() % limit);
+        raw->node.callback = [raw] {
+            if (std::chrono::steady_clock::now() < raw->due) {
+                raw->early = true;
+            }
+            raw->fired++;
+        };
+        raw->due = std::chrono::steady_clock::now() + delay;
+        wheel.arm(raw->node, delay);
+        timers.push_back(std::move(timer));
+    }
+    size_t armed = wheel.armedCount();
+    std::thread runner([&] { wheel.run(); });
+
+    // Re-arming replaces the earlier arming, and a cancelled timer never fires.
+    for (int i = 0; i < TEST_TIMERS; i += 10) {
+        if (i % 20 == 0) {
+            timers[i]->due = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+            wheel.arm(timers[i]->node, std::chrono::milliseconds(100));
+        }
+        else {
+            wheel.cancel(timers[i]->node);
+            timers[i]->cancelled = true;
+        }
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(TEST_MAX_DELAY_MS + 500));
+
+    long missing = 0, repeated = 0, early = 0, cancelledFired = 0;
+    for (const auto& timer : timers) {
+        if (timer->cancelled) {
+            cancelledFired += timer->fired > 0;
+            continue;
+        }
+        missing += timer->fired == 0;
+        repeated += timer->fired > 1;
+        early += timer->early;
+    }
+    std::cout << "Armed " << armed << " of " << TEST_TIMERS << " timers; missing: " << missing << ", fired twice: " << repeated
+              << ", early: " << early << ", cancelled but fired: " << cancelledFired << ", still armed: " << wheel.armedCount() << std::endl;
+
+    // cancel() returns only once a running callback has finished.
+    TimerNode slow;
+    std::atomic<bool> started{false}, finished{false};
+    slow.callback = [&] {
+        started = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        finished = true;
+    };
+    wheel.arm(slow, std::chrono::milliseconds(1));
+    while (!started) {
+        std::this_thread::yield();
+    }
+    wheel.cancel(slow);
+    bool waited = finished;
+    std::cout << "Cancel waited for running callback: " << (waited ? "yes" : "no") << std::endl;
+
+    wheel.stop();
+    runner.join();
+
+    bool ok = armed == TEST_TIMERS && missing == 0 && repeated == 0 && early == 0 && cancelledFired == 0 &&
+              wheel.armedCount() == 0 && waited;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,167 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// Per message tracing. A traced frame carries a trace id and the sender's
+// CLOCK_MONOTONIC send time, and every stage that touches the message
+// records a span into a fixed size lock-free ring. dumpTrace() writes the
+// ring as Chrome trace JSON with one track per message, so the slow stage
+// of a slow broadcast stands out. Send times from another host are on a
+// different clock, so network spans are only meaningful on one machine.
+
+// Name both sides put in FRAME_OPTIONS to agree on traced frames.
+inline const char* const TRACE_OPTION = "trace1";
+
+// Spans kept; older ones are overwritten. Must be a power of two.
+const size_t TRACE_RING_SIZE = 1 << 16;
+
+inline uint64_t traceNow() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000ull + now.tv_nsec;
+}
+
+inline uint64_t newTraceId() {
+    thread_local std::mt19937_64 gen(std::random_device{}());
+    uint64_t id;
+    do {
+        id = gen();
+    } while (id == 0);
+    return id;
+}
+
+// A traced item waiting in a queue: its trace id and when it was queued.
+struct TraceMark {
+    uint64_t traceId = 0;
+    uint64_t start = 0;
+};
+
+struct TraceSpan {
+    const char* name;
+    uint64_t traceId;
+    uint64_t start;
+    uint64_t end;
+    long thread;
+    long arg;
+};
+
+// Multi-producer ring. Each slot has a sequence number that is odd while a
+// writer fills it, so a dump skips slots caught mid-write or already reused.
+class TraceRing {
+public:
+    void record(const char* name, uint64_t traceId, uint64_t start, uint64_t end, long arg) {
+        uint64_t index = head.fetch_add(1, std::memory_order_relaxed);
+        Slot& slot = slots[index & (TRACE_RING_SIZE - 1)];
+        slot.sequence.store(index * 2 + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.name.store(name, std::memory_order_relaxed);
+        slot.traceId.store(traceId, std::memory_order_relaxed);
+        slot.start.store(start, std::memory_order_relaxed);
+        slot.end.store(end, std::memory_order_relaxed);
+        slot.thread.store(threadId(), std::memory_order_relaxed);
+        slot.arg.store(arg, std::memory_order_relaxed);
+        slot.sequence.store(index * 2 + 2, std::memory_order_release);
+    }
+
+    std::vector<TraceSpan> snapshot() {
+        std::vector<TraceSpan> spans;
+        uint64_t end = head.load(std::memory_order_acquire);
+        uint64_t begin = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+        for (uint64_t index = begin; index < end; index++) {
+            Slot& slot = slots[index & (TRACE_RING_SIZE - 1)];
+            if (slot.sequence.load(std::memory_order_acquire) != index * 2 + 2) {
+                continue;
+            }
+            TraceSpan span{slot.name.load(std::memory_order_relaxed), slot.traceId.load(std::memory_order_relaxed),
+                           slot.start.load(std::memory_order_relaxed), slot.end.load(std::memory_order_relaxed),
+                           slot.thread.load(std::memory_order_relaxed), slot.arg.load(std::memory_order_relaxed)};
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) == index * 2 + 2) {
+                spans.push_back(span);
+            }
+        }
+        return spans;
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> sequence{0};
+        std::atomic<const char*> name{nullptr};
+        std::atomic<uint64_t> traceId{0};
+        std::atomic<uint64_t> start{0};
+        std::atomic<uint64_t> end{0};
+        std::atomic<long> thread{0};
+        std::atomic<long> arg{0};
+    };
+
+    static long threadId() {
+        thread_local long id = syscall(SYS_gettid);
+        return id;
+    }
+
+    std::atomic<uint64_t> head{0};
+    Slot slots[TRACE_RING_SIZE];
+};
+
+inline TraceRing& traceRing() {
+    static TraceRing* ring = new TraceRing();
+    return *ring;
+}
+
+// name must be a string literal. arg, when not -1, is shown with the span;
+// the server uses it for the socket a span belongs to.
+inline void recordSpan(const char* name, uint64_t traceId, uint64_t start, uint64_t end, long arg = -1) {
+    traceRing().record(name, traceId, start, end, arg);
+}
+
+// Trace viewers want small integer track ids.
+inline long traceTrack(uint64_t traceId) {
+    return static_cast<long>(traceId & 0x7fffffff);
+}
+
+// Writes every span still in the ring to path as Chrome trace JSON, for
+// chrome://tracing or ui.perfetto.dev.
+inline bool dumpTrace(const std::string& path) {
+    std::ofstream out(path);
+    if (!out) {
+        return false;
+    }
+    int pid = getpid();
+    std::vector<TraceSpan> spans = traceRing().snapshot();
+    std::set<uint64_t> traces;
+    out << std::fixed << std::setprecision(3);
+    out << "{\"traceEvents\":[\n";
+    bool first = true;
+    for (const TraceSpan& span : spans) {
+        out << (first ? "" : ",\n") << "{\"name\":\"" << span.name << "\",\"ph\":\"X\",\"pid\":" << pid
+            << ",\"tid\":" << traceTrack(span.traceId) << ",\"ts\":" << span.start / 1000.0
+            << ",\"dur\":" << (span.end > span.start ? span.end - span.start : 0) / 1000.0
+            << ",\"args\":{\"thread\":" << span.thread;
+        if (span.arg != -1) {
+            out << ",\"socket\":" << span.arg;
+        }
+        out << "}}";
+        first = false;
+        traces.insert(span.traceId);
+    }
+    // Name each message's track after its trace id.
+    for (uint64_t traceId : traces) {
+        char name[32];
+        snprintf(name, sizeof(name), "message %016llx", static_cast<unsigned long long>(traceId));
+        out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+            << ",\"tid\":" << traceTrack(traceId) << ",\"args\":{\"name\":\"" << name << "\"}}";
+        first = false;
+    }
+    out << "\n]}\n";
+    return static_cast<bool>(out);
+}
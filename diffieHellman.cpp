@@ -1,17 +1,18 @@
+#pragma once
 #include <vector>
 #include <unistd.h>
 #include <cmath>
 #include <random>
 #include <cstdlib>
 
-int genPrivate(int P) {
+inline int genPrivate(int P) {
     std::random_device rd;
     std::mt19937 gen(rd()); 
     std::uniform_int_distribution<> dis(1, P - 1); 
     return dis(gen);
 }
 
-std::pair<int, int> genParameters() {
+inline std::pair<int, int> genParameters() {
     std::vector<std::pair<int, int>> paramPairs = {
         {23, 2}, {47, 5}, {17, 3}, {29, 2}, {31, 5}, {19, 3}, {37, 2}, {71,3}, {97,5}, {113,2}, {131,3}, {157,2}
     };
@@ -20,7 +21,7 @@ std::pair<int, int> genParameters() {
     return paramPairs[position];
 }
 
-int computePublic(int gVal, int pVal, int privateKey) {
+inline int computePublic(int gVal, int pVal, int privateKey) {
 
     int result = 1;
     for (int i = 0; i < privateKey; ++i) {
@@ -31,7 +32,7 @@ int computePublic(int gVal, int pVal, int privateKey) {
     return result; 
 }
 
-int resolveKey(int otherKey, int yourKey, int pVal) {
+inline int resolveKey(int otherKey, int yourKey, int pVal) {
     
     int result = 1;
     for (int i = 0; i < yourKey; ++i) {
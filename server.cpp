@@ -1,15 +1,32 @@
 #include <iostream>
+#include <cerrno>
 #include <cstring>
+#include <cstdlib>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <thread>
 #include <vector>
 #include <algorithm>
 #include <cmath>
 #include <random>
 #include <sstream>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <charconv>
+#include <condition_variable>
+#include <csignal>
 #include "diffieHellman.cpp"
+#include "RSAKeys.cpp"
 #include "CaesarCipher.cpp"
+#include "ModExpBatch.cpp"
+#include "Streaming.cpp"
+#include "Compression.cpp"
+#include "HandshakePool.cpp"
+#include "Handoff.cpp"
+#include "TimerWheel.cpp"
+#include "RateLimit.cpp"
 
 const int PORT = 8003;
 
@@ -19,272 +36,953 @@ struct ClientInfo {
     int modulus;
     int clientDHpublic;
     int serverDHPrivate;
+    int caesarKey;
+    bool compression;
+    bool tracing;
+    bool group;
+    // Whether the client answers FRAME_PING.
+    bool heartbeat;
+    // First room key epoch the client was given, 0 until it has one.
+    uint32_t groupEpoch;
+    std::shared_ptr<SendQueue> outbound;
 };
 
 std::vector<ClientInfo> clients;
+std::mutex clientsMutex;
+std::atomic<uint32_t> nextRelayStreamId{1};
+
+// Room keys and pending rotations are guarded by clientsMutex.
+RoomKey currentRoomKey, previousRoomKey;
+bool rotationPending = false;
+// Set while sessions are being handed to a new process.
+bool rotationPaused = false;
+std::condition_variable membershipChanged;
+
+// Joins and leaves within this long share one room key rotation.
+const std::chrono::milliseconds ROOM_KEY_ROTATE_DELAY(100);
 
 int serverPublicKey, serverPrivateKey, serverModulus;
 
-bool isPrime(int n) {
-    if (n <= 1) return false;
-    if (n <= 3) return true;
-    if (n % 2 == 0 || n % 3 == 0) return false;
-    for (int i = 5; i * i <= n; i += 6) {
-        if (n % i == 0 || n % (i + 2) == 0) return false;
+SessionGate sessionGate;
+
+// Handshake deadlines and session heartbeats.
+TimerWheel timers;
+
+// A heartbeat client idle this long is pinged, and one that stays silent
+// until IDLE_TIMEOUT is taken for dead and disconnected.
+const std::chrono::milliseconds HEARTBEAT_INTERVAL(15000);
+const std::chrono::milliseconds IDLE_TIMEOUT(45000);
+
+// Clients that do not answer pings fall back on TCP keepalive probes.
+const int KEEPALIVE_IDLE_SECONDS = 60;
+const int KEEPALIVE_INTERVAL_SECONDS = 10;
+const int KEEPALIVE_PROBES = 3;
+
+std::atomic<long> reapedSessions{0};
+
+// Connections the handshake pool turned away are counted and reported at
+// most this often, so a flood does not turn into console output.
+const std::chrono::milliseconds REJECTION_REPORT_INTERVAL(1000);
+std::atomic<long> unreportedRejections{0};
+TimerNode rejectionReport;
+
+// Limits on what each client, and the whole room, may send, in messages
+// and in wire bytes per second; 0 means unlimited. Set from the command
+// line. Stream chunks count towards bytes but not messages.
+double clientMessageRate = 20;
+double clientByteRate = 4 * 1024 * 1024;
+double roomMessageRate = 200;
+double roomByteRate = 16 * 1024 * 1024;
+// Whether chat over a limit is held back for up to
+// RATE_LIMIT_MAX_DELAY_NS or refused straight away.
+bool rejectOverLimit = false;
+// Buckets hold this many seconds' worth of sending.
+const double RATE_LIMIT_BURST_SECONDS = 2;
+
+RateLimiter roomLimits;
+std::atomic<long> delayedFrames{0};
+std::atomic<long> rejectedFrames{0};
+
+// Parses the decimal RSA blocks of a payload, decrypts them with privateKey
+// and undoes the sender's Caesar shift into a pooled buffer, inflating it
+// when the frame is compressed. Returns an empty ref on malformed input.
+MessageRef decryptPayload(const Frame& frame, int privateKey, int modulus, int caesarKey) {
+    thread_local std::vector<int> blocks;
+    blocks.clear();
+    const char* cursor = frame.payload.data();
+    const char* end = cursor + frame.payload.size();
+    while (true) {
+        while (cursor < end && *cursor == ' ') {
+            cursor++;
+        }
+        int encrypted;
+        std::from_chars_result parsed = std::from_chars(cursor, end, encrypted);
+        if (parsed.ec != std::errc()) {
+            break;
+        }
+        blocks.push_back(encrypted);
+        cursor = parsed.ptr;
     }
-    return true;
-}
+    modExpBatch(blocks, privateKey, modulus);
+
+    MessageRef plaintext = MessageRef::allocate(blocks.size());
+    if (!plaintext) {
+        return plaintext;
+    }
+    for (size_t i = 0; i < blocks.size(); i++) {
+        plaintext.data()[i] = caesarShift(-caesarKey, static_cast<char>(blocks[i] % 256));
+    }
+    plaintext.setSize(blocks.size());
 
-int generateRandomPrime(int min, int max) {
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<int> dist(min, max);
-    int candidate = dist(gen);
-    while (!isPrime(candidate)) {
-        candidate = dist(gen);
+    if (frame.flags & FRAME_FLAG_COMPRESSED) {
+        MessageRef inflated = MessageRef::allocate(STREAM_CHUNK_SIZE);
+        size_t length;
+        if (!decompressInto(plaintext.data(), plaintext.size(), inflated.data(), STREAM_CHUNK_SIZE, length)) {
+            return MessageRef();
+        }
+        inflated.setSize(length);
+        return inflated;
     }
-    return candidate;
+    return plaintext;
 }
 
-int gcd(int a, int b) {
-    if (b == 0) return a;
-    return gcd(b, a % b);
+MessageRef decryptFromClient(const Frame& frame, int caesarKey) {
+    return decryptPayload(frame, serverPrivateKey, serverModulus, caesarKey);
 }
 
-int modInverse(int a, int m) {
-    a = a % m;
-    for (int x = 1; x < m; x++) {
-        if ((a * x) % m == 1) return x;
+// Decimal encodes RSA encrypted blocks for one client straight into a pooled
+// frame, without any intermediate strings. A non-zero traceId adds a trace
+// context, whose send time the SendQueue fills in.
+MessageRef encodeFrameForClient(const ClientInfo& client, uint8_t type, uint32_t streamId, const int* blocks, size_t count, uint8_t flags,
+                                uint64_t traceId) {
+    // Every block is below the modulus, so it takes at most this many digits.
+    size_t digits = 1;
+    for (int limit = client.modulus - 1; limit >= 10; limit /= 10) {
+        digits++;
+    }
+    size_t contextSize = traceId != 0 ? TRACE_CONTEXT_SIZE : 0;
+    MessageRef frame = MessageRef::allocate(FRAME_HEADER_SIZE + contextSize + count * (digits + 1));
+    if (!frame) {
+        return frame;
     }
-    return -1;
-}
 
-int modExp(int base, int exponent, int modulus) {
-    if (modulus == 1)
-        return 0;
-    int result = 1;
-    base = base % modulus;
-    while (exponent > 0) {
-        if (exponent % 2 == 1)
-            result = (result * base) % modulus;
-        exponent = exponent >> 1;
-        base = (base * base) % modulus;
-    }
-    return result;
+    char* payload = frame.data() + FRAME_HEADER_SIZE;
+    char* out = payload;
+    if (traceId != 0) {
+        writeTraceContext(out, traceId, 0);
+        out += TRACE_CONTEXT_SIZE;
+        flags |= FRAME_FLAG_TRACED;
+    }
+    char* end = frame.data() + frame.capacity();
+    for (size_t i = 0; i < count; i++) {
+        out = std::to_chars(out, end, blocks[i]).ptr;
+        *out++ = ' ';
+    }
+    size_t payloadLength = out - payload;
+    if (payloadLength > MAX_FRAME_PAYLOAD) {
+        return MessageRef();
+    }
+    writeFrameHeader(frame.data(), type, streamId, payloadLength, flags);
+    frame.setSize(FRAME_HEADER_SIZE + payloadLength);
+    return frame;
 }
 
-int modPow(int base, int exponent, int modulus) {
-    int result = 1;
-    base = base % modulus;
-    while (exponent > 0) {
-        if (exponent % 2 == 1)
-            result = (result * base) % modulus;
-        exponent = exponent >> 1;
-        base = (base * base) % modulus;
+// Encrypts a short control payload for one client, outside any broadcast.
+MessageRef sealForClient(const ClientInfo& client, uint8_t type, uint32_t streamId, const std::string& plaintext) {
+    thread_local std::vector<int> blocks;
+    blocks.resize(plaintext.size());
+    for (size_t i = 0; i < plaintext.size(); i++) {
+        blocks[i] = static_cast<unsigned char>(caesarShift(client.caesarKey, plaintext[i]));
     }
-    return result;
+    modExpBatch(blocks, client.publicKey, client.modulus);
+    return encodeFrameForClient(client, type, streamId, blocks.data(), blocks.size(), 0, 0);
 }
 
-void generateKeys(int p, int q, int &n, int &e, int &d) {
-    n = p * q;
-    int phi = (p - 1) * (q - 1);
-
-    for (e = 2; e < phi; e++) {
-        if (gcd(e, phi) == 1)
-            break;
-    }
+// A frame without payload, such as FRAME_PING.
+MessageRef emptyFrame(uint8_t type) {
+    MessageRef frame = MessageRef::allocate(FRAME_HEADER_SIZE);
+    writeFrameHeader(frame.data(), type, 0, 0, 0);
+    frame.setSize(FRAME_HEADER_SIZE);
+    return frame;
+}
 
-    d = modInverse(e, phi);
+// Tells a client something it sent, or the stream streamId, was refused.
+MessageRef errorFrame(uint32_t streamId, const std::string& reason) {
+    MessageRef frame = MessageRef::allocate(FRAME_HEADER_SIZE + reason.size());
+    writeFrameHeader(frame.data(), FRAME_ERROR, streamId, reason.size(), 0);
+    std::memcpy(frame.data() + FRAME_HEADER_SIZE, reason.data(), reason.size());
+    frame.setSize(FRAME_HEADER_SIZE + reason.size());
+    return frame;
 }
 
-bool sendPublicKey(int clientSocket, int publicKey, int modulus) {
-    std::string keyMessage = std::to_string(publicKey) + "," + std::to_string(modulus);
-    if (send(clientSocket, keyMessage.c_str(), keyMessage.length(), 0) < 0) {
-        std::cerr << "Error sending public key to client." << std::endl;
-        return false;
-    }
-    return true;
+// Sizes buckets for rate limits. A byte bucket always holds the largest
+// frame, or that frame could never pass.
+void configureLimiter(RateLimiter& limiter, double messageRate, double byteRate) {
+    limiter.messages.configure(messageRate, messageRate * RATE_LIMIT_BURST_SECONDS);
+    double burst = byteRate * RATE_LIMIT_BURST_SECONDS;
+    limiter.bytes.configure(byteRate, std::max(burst, static_cast<double>(FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD)));
 }
 
-bool sendDHPandG(int clientSocket, int pVal, int gVal) {
-std::string keyMessage = std::to_string(pVal) + "," + std::to_string(gVal);
-    if (send(clientSocket, keyMessage.c_str(), keyMessage.length(), 0) < 0) {
-        std::cerr << "Error sending DH parameters to client." << std::endl;
-        return false;
+// Charges a frame to its sender's limits and the room's, then sleeps as
+// long as either asks. Stream frames always wait, since dropping one would
+// break the transfer; not reading meanwhile slows the sender through TCP.
+// Chat that would wait too long, or at all with rejectOverLimit, is
+// refused and false returned.
+bool throttle(RateLimiter& clientLimits, const Frame& frame) {
+    bool chat = frame.type == FRAME_CHAT || frame.type == FRAME_GROUP_CHAT;
+    double messages = frame.type == FRAME_STREAM_CHUNK || frame.type == FRAME_STREAM_END ? 0 : 1;
+    double bytes = FRAME_HEADER_SIZE + frame.payload.size();
+    uint64_t maxDelay = chat && rejectOverLimit ? 0 : RATE_LIMIT_MAX_DELAY_NS;
+    uint64_t delay, roomDelay;
+    while (true) {
+        uint64_t now = traceNow();
+        if (clientLimits.take(messages, bytes, now, maxDelay, delay)) {
+            if (roomLimits.take(messages, bytes, now, maxDelay, roomDelay)) {
+                delay = std::max(delay, roomDelay);
+                break;
+            }
+            clientLimits.refund(messages, bytes);
+            delay = roomDelay;
+        }
+        if (chat) {
+            rejectedFrames++;
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::nanoseconds(delay - maxDelay));
+    }
+    if (delay > 0) {
+        delayedFrames++;
+        std::this_thread::sleep_for(std::chrono::nanoseconds(delay));
     }
     return true;
 }
 
+// Whether a client holds the room key of epoch.
+bool canReadEpoch(const ClientInfo& client, uint32_t epoch) {
+    return client.group && client.groupEpoch != 0 && client.groupEpoch <= epoch;
+}
 
-bool sendDHPublicKey(int clientSocket, int publicKey) {
-    std::string keyMessage = std::to_string(publicKey);
-    if (send(clientSocket, keyMessage.c_str(), keyMessage.length(), 0) < 0) {
-        std::cerr << "Error sending DH public key to client." << std::endl;
-        return false;
+void printMemoryStats() {
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    std::cout << "Message pool: " << MessagePool::instance().inUseBytes() << " bytes in use, "
+              << MessagePool::instance().reservedBytes() << " reserved";
+    for (const auto& client : clients) {
+        std::cout << "; client " << client.socket << ": " << client.outbound->memoryUsed() << " queued";
     }
-    return true;
+    std::cout << std::endl;
 }
 
+// Blocks one relay encrypts in a single pass. Every payload block takes at
+// least two characters of a frame, so no recipient's copy is larger.
+const size_t RELAY_BATCH_BLOCKS = MAX_FRAME_PAYLOAD / 2;
 
-bool receivePublicKey(int clientSocket, int& publicKey, int& modulus) {
-    char buffer[1024];
-    int valread = read(clientSocket, buffer, 1024);
-    if (valread <= 0) {
-        std::cerr << "Error receiving public key from client." << std::endl;
-        return false;
+// Frames of one relayed stream that may wait for a recipient. A recipient
+// this far behind is dropped from the stream so the sender never waits.
+const size_t RELAY_STREAM_BACKLOG = 64;
+
+// Re-encrypts plaintext for each of recipients and queues it. Stream frames
+// go through the bulk lane without waiting; recipients whose backlog for
+// the stream is full are added to stalled instead.
+// The plaintext, and its compressed form, are shared by all recipients.
+// traceId is that of the incoming message, or zero when it is not traced.
+void relayTo(const std::vector<ClientInfo>& recipients, uint8_t type, uint32_t streamId, const MessageRef& plaintext,
+             uint64_t traceId = 0, std::vector<std::shared_ptr<SendQueue>>* stalled = nullptr) {
+    if (recipients.empty()) {
+        return;
     }
 
-    std::string keyMessage(buffer);
-    size_t delimiterPos = keyMessage.find(",");
-    if (delimiterPos == std::string::npos) {
-        std::cerr << "Invalid format for public key message." << std::endl;
-        return false;
+    // Compress once for every recipient that negotiated it.
+    MessageRef compressed;
+    if (plaintext.size() >= COMPRESS_MIN_SIZE) {
+        compressed = MessageRef::allocate(plaintext.size());
+        size_t length;
+        if (compressed && compressInto(plaintext.data(), plaintext.size(), compressed.data(), compressed.capacity(), length)) {
+            compressed.setSize(length);
+        }
+        else {
+            compressed = MessageRef();
+        }
     }
 
-    publicKey = std::stoi(keyMessage.substr(0, delimiterPos));
-    modulus = std::stoi(keyMessage.substr(delimiterPos + 1));
+    // Caesar shift the copies of a batch of recipients into one run of
+    // blocks, each tagged with its recipient's key, so one multi-key pass
+    // encrypts for the whole batch. The buffers hold the largest payload a
+    // frame can carry and keep that size however many clients there are.
+    thread_local std::vector<int> blocks(RELAY_BATCH_BLOCKS);
+    thread_local std::vector<uint8_t> keys(RELAY_BATCH_BLOCKS);
+    int exponents[MULTI_KEY_MAX_KEYS], moduli[MULTI_KEY_MAX_KEYS];
+    size_t offsets[MULTI_KEY_MAX_KEYS + 1];
+    size_t next = 0;
+    while (next < recipients.size()) {
+        uint64_t batchStarted = traceNow();
+        size_t first = next;
+        size_t used = 0;
+        size_t keyCount = 0;
+        while (next < recipients.size() && keyCount < MULTI_KEY_MAX_KEYS) {
+            const ClientInfo& otherClient = recipients[next];
+            const MessageRef& payload = compressed && otherClient.compression ? compressed : plaintext;
+            if (used + payload.size() > RELAY_BATCH_BLOCKS) {
+                break;
+            }
+            offsets[keyCount] = used;
+            for (size_t i = 0; i < payload.size(); i++) {
+                blocks[used + i] = static_cast<unsigned char>(caesarShift(otherClient.caesarKey, payload.data()[i]));
+            }
+            std::fill(keys.begin() + used, keys.begin() + used + payload.size(), static_cast<uint8_t>(keyCount));
+            exponents[keyCount] = otherClient.publicKey;
+            moduli[keyCount] = otherClient.modulus;
+            used += payload.size();
+            keyCount++;
+            next++;
+        }
+        if (keyCount == 0) {
+            // Only a payload no frame can carry gets here.
+            std::cerr << "Message too large for client " << recipients[next].socket << std::endl;
+            next++;
+            continue;
+        }
+        offsets[keyCount] = used;
+        modExpMultiKey(blocks.data(), keys.data(), used, exponents, moduli, keyCount);
+        if (traceId != 0) {
+            recordSpan("server.encrypt", traceId, batchStarted, traceNow());
+        }
 
-    return true;
+        for (size_t k = 0; k < keyCount; k++) {
+            const ClientInfo& otherClient = recipients[first + k];
+            // sending stuff
+            uint8_t flags = compressed && otherClient.compression ? FRAME_FLAG_COMPRESSED : 0;
+            MessageRef frame = encodeFrameForClient(otherClient, type, streamId, blocks.data() + offsets[k], offsets[k + 1] - offsets[k], flags,
+                                                    otherClient.tracing ? traceId : 0);
+            if (!frame) {
+                std::cerr << "Message too large for client " << otherClient.socket << std::endl;
+                continue;
+            }
+            if (type == FRAME_CHAT) {
+                std::cout << "With key: " << otherClient.publicKey << std::endl;
+                std::cout << "Encrypted text: ";
+                std::cout.write(frame.data() + FRAME_HEADER_SIZE, frame.size() - FRAME_HEADER_SIZE) << std::endl;
+                TraceMark mark;
+                mark.traceId = traceId;
+                mark.start = traceNow();
+                if (!otherClient.outbound->pushChat(std::move(frame), mark)) {
+                    std::cerr << "Dropping message for slow client " << otherClient.socket << std::endl;
+                }
+            }
+            else if (!otherClient.outbound->pushBulk(streamId, std::move(frame), RELAY_STREAM_BACKLOG) && stalled) {
+                stalled->push_back(otherClient.outbound);
+            }
+        }
+    }
 }
 
-bool receiveDHPublicKey(int clientSocket, int& publicKey) {
-    char buffer[1024];
-    int valread = read(clientSocket, buffer, 1024);
-    if (valread <= 0) {
-        std::cerr << "Error receiving public key from client." << std::endl;
-        return false;
+// Relays a chat message to every client but the sender.
+void relayToOthers(int senderSocket, const MessageRef& plaintext, uint64_t traceId = 0) {
+    thread_local std::vector<ClientInfo> recipients;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        recipients.clear();
+        for (const auto& client : clients) {
+            if (client.socket != senderSocket) {
+                recipients.push_back(client);
+            }
+        }
     }
-    std::string keyMessage(buffer);
+    relayTo(recipients, FRAME_CHAT, 0, plaintext, traceId);
+    recipients.clear();
+}
 
-    publicKey = std::stoi(keyMessage);
+// A stream a client is sending, under the id it is relayed with. Its
+// recipients are fixed when it begins, so a client that connects later
+// never gets chunks of a stream whose STREAM_BEGIN it missed.
+struct RelayStream {
+    uint32_t relayId;
+    std::vector<std::weak_ptr<SendQueue>> recipients;
+};
 
-    return true;
+// Relays a frame of a stream to those of its recipients that are still
+// connected. Recipients too far behind are dropped from the stream and told
+// so with a FRAME_ERROR carrying the relay id.
+void relayStreamFrame(RelayStream& stream, uint8_t type, const MessageRef& plaintext) {
+    thread_local std::vector<ClientInfo> recipients;
+    thread_local std::vector<std::shared_ptr<SendQueue>> stalled;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        recipients.clear();
+        for (const auto& recipient : stream.recipients) {
+            std::shared_ptr<SendQueue> outbound = recipient.lock();
+            auto client = std::find_if(clients.begin(), clients.end(), [&](const ClientInfo& info) {
+                return outbound && info.outbound == outbound;
+            });
+            if (client != clients.end()) {
+                recipients.push_back(*client);
+            }
+        }
+    }
+    stalled.clear();
+    relayTo(recipients, type, stream.relayId, plaintext, 0, &stalled);
+    recipients.clear();
+    for (const auto& outbound : stalled) {
+        stream.recipients.erase(std::remove_if(stream.recipients.begin(), stream.recipients.end(),
+                                               [&](const std::weak_ptr<SendQueue>& recipient) {
+                                                   return recipient.lock() == outbound;
+                                               }),
+                                stream.recipients.end());
+        std::cerr << "Dropping slow client from stream " << stream.relayId << std::endl;
+        outbound->pushChat(errorFrame(stream.relayId, "too far behind, stream dropped"));
+    }
+    stalled.clear();
 }
 
-
-std::string rsaDecrypt(const std::string& encryptedMessage, int privateKey, int modulus) {
-    std::string decryptedMessage;
-    std::stringstream iss(encryptedMessage);
-    int encrypted;
-    while (iss >> encrypted) {
-        int decrypted = modPow(encrypted, privateKey, modulus);
-        decrypted = decrypted % 256;
-        decryptedMessage += static_cast<char>(decrypted);
+// Starts relaying a stream to every client but the sender.
+void beginRelayStream(int senderSocket, RelayStream& stream, const MessageRef& name) {
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        for (const auto& client : clients) {
+            if (client.socket != senderSocket) {
+                stream.recipients.push_back(client.outbound);
+            }
+        }
     }
-    return decryptedMessage;
+    relayStreamFrame(stream, FRAME_STREAM_BEGIN, name);
 }
 
-std::vector<int> rsaEncrypt(const std::string &plaintext, int e, int n) {
-    std::vector<int> ciphertext;
-    for (char c : plaintext) {
-        ciphertext.push_back(modExp(c, e, n));
+// Adds a client whose handshake the HandshakePool finished to the broadcast
+// list. Runs on the handshake worker so the client is visible to relays as
+// soon as possible.
+ClientInfo registerClient(const HandshakeResult& handshake) {
+    std::cout << "Client established, public key: " << handshake.clientPublicKey << ", " << handshake.clientModulus
+              << ", compression: " << (handshake.compression ? COMPRESSION_CODEC : "none") << std::endl;
+
+    int caesarKey = resolveKey(handshake.clientDHpublic, handshake.serverDHPrivate, handshake.pVal);
+    ClientInfo info{handshake.socket, handshake.clientPublicKey, handshake.clientModulus, handshake.clientDHpublic,
+                    handshake.serverDHPrivate, caesarKey, handshake.compression, handshake.tracing, handshake.group, handshake.heartbeat, 0,
+                    std::make_shared<SendQueue>(handshake.socket)};
+    std::lock_guard<std::mutex> lock(clientsMutex);
+    clients.push_back(info);
+    if (info.group) {
+        rotationPending = true;
+        membershipChanged.notify_one();
     }
-    return ciphertext;
+    return info;
 }
 
-void handleClient(int clientSocket) {
-    // RSA exchange 
-    int clientPublicKey, clientModulus;
+// Replaces the room key and sends the new one to every group member over
+// its own channel. Called with clientsMutex held, so no group message can
+// be relayed under the new epoch before every member has its key queued.
+void rotateRoomKey() {
+    RoomKey key;
+    key.epoch = currentRoomKey.epoch + 1;
+    generateKeyPair(key.modulus, key.publicKey, key.privateKey);
+    key.caesarKey = 1 + std::random_device()() % 25;
+    key.compression = true;
+    size_t members = 0;
+    for (const auto& client : clients) {
+        if (client.group) {
+            key.compression = key.compression && client.compression;
+            members++;
+        }
+    }
+    if (members == 0) {
+        return;
+    }
+    previousRoomKey = currentRoomKey;
+    currentRoomKey = key;
 
-    std::cout << "sent server rsa key: " << serverPublicKey << " and Mod: " << serverModulus << std::endl;
+    std::string record = encodeRoomKey(key);
+    for (auto& client : clients) {
+        if (!client.group) {
+            continue;
+        }
+        MessageRef frame = sealForClient(client, FRAME_GROUP_KEY, key.epoch, record);
+        if (frame && client.outbound->pushChat(std::move(frame))) {
+            if (client.groupEpoch == 0) {
+                client.groupEpoch = key.epoch;
+            }
+        }
+        else {
+            // Without this key the client cannot read the room any more.
+            client.groupEpoch = 0;
+        }
+    }
+    std::cout << "Room key rotated to epoch " << key.epoch << " for " << members << " members." << std::endl;
+}
 
-    if (!receivePublicKey(clientSocket, clientPublicKey, clientModulus)) {
-        close(clientSocket);
+// Rotates the room key after membership changes. Waiting a little first
+// lets a burst of joins or leaves share one rotation.
+void roomKeyRotator() {
+    std::unique_lock<std::mutex> lock(clientsMutex);
+    while (true) {
+        membershipChanged.wait(lock, [] { return rotationPending && !rotationPaused; });
+        lock.unlock();
+        std::this_thread::sleep_for(ROOM_KEY_ROTATE_DELAY);
+        lock.lock();
+        if (rotationPaused) {
+            continue;
+        }
+        rotationPending = false;
+        rotateRoomKey();
+    }
+}
+
+// Forwards a message encrypted under a room key. Members that hold the key
+// all share one copy of the frame, so the cost does not grow with the room;
+// only clients without the key need the server to decrypt and re-encrypt.
+void relayGroupMessage(int senderSocket, const Frame& frame) {
+    uint64_t started = traceNow();
+    uint32_t epoch = frame.streamId;
+    RoomKey key;
+    thread_local std::vector<ClientInfo> recipients;
+    std::shared_ptr<SendQueue> sender;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        if (epoch != 0 && epoch == currentRoomKey.epoch) {
+            key = currentRoomKey;
+        }
+        else if (epoch != 0 && epoch == previousRoomKey.epoch) {
+            key = previousRoomKey;
+        }
+        else {
+            for (const auto& client : clients) {
+                if (client.socket == senderSocket) {
+                    sender = client.outbound;
+                }
+            }
+        }
+        if (key.epoch != 0) {
+            recipients.assign(clients.begin(), clients.end());
+        }
+    }
+    if (key.epoch == 0) {
+        // Two quick rotations retire a key the sender may still be using;
+        // tell it so it can send again under the new one.
+        std::cerr << "Dropping group message for unknown epoch " << epoch << std::endl;
+        if (sender) {
+            sender->pushChat(errorFrame(0, "room key " + std::to_string(epoch) + " expired, message dropped"));
+        }
         return;
     }
-    
-    std::cout << "Received public key from client: " << clientPublicKey << ", " << clientModulus << std::endl;
-    
-    // Diffie Hellman Exchange
-    std::pair<int, int> PandG = genParameters();
-    auto [pVal,gVal] = PandG;
-    int serverDHPrivate = genPrivate(pVal);
-    std::cout << "server Private exponent: " << serverDHPrivate << std::endl;
-    int serverDHPublic = computePublic(gVal, pVal, serverDHPrivate);
-    int clientDHpublic;
 
-    if(!sendDHPandG(clientSocket, pVal, gVal)) {
-	close(clientSocket);
-	return;
+    MessageRef shared = MessageRef::allocate(FRAME_HEADER_SIZE + frame.payload.size());
+    if (!shared) {
+        recipients.clear();
+        return;
     }
-    std::cout << "sent Pval: " << pVal << " and Gval: " << gVal << std::endl;
-        
+    writeFrameHeader(shared.data(), FRAME_GROUP_CHAT, epoch, frame.payload.size(), frame.flags & FRAME_FLAG_COMPRESSED);
+    std::memcpy(shared.data() + FRAME_HEADER_SIZE, frame.payload.data(), frame.payload.size());
+    shared.setSize(FRAME_HEADER_SIZE + frame.payload.size());
 
-    if(!receiveDHPublicKey(clientSocket, clientDHpublic)) {
-	close(clientSocket);
-	return;
+    // Members that trace share a second copy that carries the trace context.
+    MessageRef sharedTraced;
+    if (frame.traceId != 0) {
+        size_t length = TRACE_CONTEXT_SIZE + frame.payload.size();
+        sharedTraced = MessageRef::allocate(FRAME_HEADER_SIZE + length);
+        if (sharedTraced && length <= MAX_FRAME_PAYLOAD) {
+            writeFrameHeader(sharedTraced.data(), FRAME_GROUP_CHAT, epoch, length,
+                             (frame.flags & FRAME_FLAG_COMPRESSED) | FRAME_FLAG_TRACED);
+            writeTraceContext(sharedTraced.data() + FRAME_HEADER_SIZE, frame.traceId, traceNow());
+            std::memcpy(sharedTraced.data() + FRAME_HEADER_SIZE + TRACE_CONTEXT_SIZE, frame.payload.data(), frame.payload.size());
+            sharedTraced.setSize(FRAME_HEADER_SIZE + length);
+        }
+        else {
+            sharedTraced = MessageRef();
+        }
     }
 
-    std::cout << "Received DH public from client: " << clientDHpublic << std::endl;
+    // Clients without the key, decided from the same snapshot, so none of
+    // them gets both the shared frame and a copy of its own.
+    thread_local std::vector<ClientInfo> fallback;
+    fallback.clear();
+    for (const auto& otherClient : recipients) {
+        if (otherClient.socket == senderSocket) {
+            continue;
+        }
+        if (!canReadEpoch(otherClient, epoch)) {
+            fallback.push_back(otherClient);
+            continue;
+        }
+        TraceMark mark;
+        mark.traceId = frame.traceId;
+        mark.start = traceNow();
+        if (!otherClient.outbound->pushChat(otherClient.tracing && sharedTraced ? sharedTraced : shared, mark)) {
+            std::cerr << "Dropping message for slow client " << otherClient.socket << std::endl;
+        }
+    }
+    recipients.clear();
+    if (frame.traceId != 0) {
+        recordSpan("server.relay", frame.traceId, started, traceNow());
+    }
+    std::cout << "Relayed group message for epoch " << epoch << ": " << frame.payload << std::endl;
 
-    if(!sendDHPublicKey(clientSocket, serverDHPublic)) {
-	close(clientSocket);
-	return;
+    if (!fallback.empty()) {
+        MessageRef plaintext = decryptPayload(frame, key.privateKey, key.modulus, key.caesarKey);
+        if (plaintext) {
+            relayTo(fallback, FRAME_CHAT, 0, plaintext, frame.traceId);
+        }
+        fallback.clear();
     }
+}
 
-    std::cout << "sent DH server Public Key: " << serverDHPublic << std::endl;
+// relayStreams maps the client's stream ids to the streams being relayed;
+// it is only non-empty for sessions taken over from a previous server process.
+void handleClient(ClientInfo info, std::map<uint32_t, RelayStream> relayStreams) {
+    int clientSocket = info.socket;
+    int caesarKey = info.caesarKey;
+    std::shared_ptr<SendQueue> outbound = info.outbound;
 
+    // Bound how long a send to a vanished peer can block its writer.
+    unsigned int userTimeout = IDLE_TIMEOUT.count();
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_USER_TIMEOUT, &userTimeout, sizeof(userTimeout));
 
-    
+    // Set while a frame is being handled, which a rate limit delay can hold
+    // up without the client being idle.
+    std::atomic<bool> busy{false};
+    RateLimiter limits;
+    configureLimiter(limits, clientMessageRate, clientByteRate);
 
-    clients.push_back({clientSocket, clientPublicKey, clientModulus, clientDHpublic, serverDHPrivate });
-    
+    std::atomic<std::chrono::steady_clock::rep> lastActivity{std::chrono::steady_clock::now().time_since_epoch().count()};
+    TimerNode heartbeat;
+    if (info.heartbeat) {
+        heartbeat.callback = [&] {
+            auto now = std::chrono::steady_clock::now();
+            if (busy || sessionGate.isClosed()) {
+                // Parked and busy sessions read nothing, so silence means
+                // nothing yet.
+                lastActivity = now.time_since_epoch().count();
+                timers.arm(heartbeat, HEARTBEAT_INTERVAL);
+                return;
+            }
+            auto idle = std::chrono::duration_cast<std::chrono::milliseconds>(
+                now - std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(lastActivity.load())));
+            if (idle >= IDLE_TIMEOUT) {
+                // Wakes the session's read and writer so the session ends.
+                std::cout << "Reaping client " << clientSocket << " after " << idle.count() << "ms of silence, "
+                          << ++reapedSessions << " reaped so far." << std::endl;
+                shutdown(clientSocket, SHUT_RDWR);
+                return;
+            }
+            if (idle < HEARTBEAT_INTERVAL) {
+                timers.arm(heartbeat, HEARTBEAT_INTERVAL - idle);
+                return;
+            }
+            outbound->pushChat(emptyFrame(FRAME_PING));
+            timers.arm(heartbeat, HEARTBEAT_INTERVAL);
+        };
+        timers.arm(heartbeat, HEARTBEAT_INTERVAL);
+    }
+    else {
+        int on = 1;
+        setsockopt(clientSocket, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        setsockopt(clientSocket, IPPROTO_TCP, TCP_KEEPIDLE, &KEEPALIVE_IDLE_SECONDS, sizeof(int));
+        setsockopt(clientSocket, IPPROTO_TCP, TCP_KEEPINTVL, &KEEPALIVE_INTERVAL_SECONDS, sizeof(int));
+        setsockopt(clientSocket, IPPROTO_TCP, TCP_KEEPCNT, &KEEPALIVE_PROBES, sizeof(int));
+    }
 
     // Receiving stuff
-    char buffer[1024];
+    Frame frame;
     while (true) {
-        int valread = read(clientSocket, buffer, 1024);
-        if (valread <= 0) {
+        busy = false;
+        if (!sessionGate.waitReadable(clientSocket)) {
+            // Each stream is its id, its relay id and the sockets of the
+            // recipients still connected.
+            std::string streams;
+            {
+                std::lock_guard<std::mutex> lock(clientsMutex);
+                for (const auto& stream : relayStreams) {
+                    std::vector<int> sockets;
+                    for (const auto& recipient : stream.second.recipients) {
+                        std::shared_ptr<SendQueue> outbound = recipient.lock();
+                        for (const auto& client : clients) {
+                            if (outbound && client.outbound == outbound) {
+                                sockets.push_back(client.socket);
+                            }
+                        }
+                    }
+                    streams += " " + std::to_string(stream.first) + " " + std::to_string(stream.second.relayId) + " " +
+                               std::to_string(sockets.size());
+                    for (int socket : sockets) {
+                        streams += " " + std::to_string(socket);
+                    }
+                }
+            }
+            sessionGate.park(clientSocket, streams);
+            continue;
+        }
+        if (!receiveFrame(clientSocket, frame)) {
             std::cout << "Client disconnected." << std::endl;
             break;
         }
-        buffer[valread] = '\0'; 
-	
-        std::cout << "Received encrypted message from client: " << buffer << std::endl;
-        std::string decryptedMessage = rsaDecrypt(buffer, serverPrivateKey, serverModulus);
-	int caesarKey = resolveKey(clientDHpublic, serverDHPrivate, pVal);
-	std::string plaintext = caesarDecrypt(caesarKey, decryptedMessage.c_str()); 
+        busy = true;
+        lastActivity = std::chrono::steady_clock::now().time_since_epoch().count();
+        uint64_t receivedAt = traceNow();
+        if (frame.traceId != 0) {
+            recordSpan("network", frame.traceId, frame.sentAt, receivedAt, clientSocket);
+        }
+        if (frame.type == FRAME_PING || frame.type == FRAME_PONG) {
+            // Liveness frames count against the client's own limit like any
+            // message, but are never held back: over the limit they are
+            // dropped unanswered, so a ping flood cannot fill the chat lane.
+            uint64_t delay;
+            bool allowed = limits.take(1, FRAME_HEADER_SIZE + frame.payload.size(), traceNow(), 0, delay);
+            if (allowed && frame.type == FRAME_PING) {
+                outbound->pushChat(emptyFrame(FRAME_PONG));
+            }
+            continue;
+        }
+        if (!throttle(limits, frame)) {
+            std::cerr << "Rate limited client " << clientSocket << ", " << rejectedFrames << " frames refused and " << delayedFrames
+                      << " delayed so far." << std::endl;
+            outbound->pushChat(errorFrame(0, "rate limited, message dropped"));
+            continue;
+        }
+        if (frame.type == FRAME_GROUP_CHAT) {
+            relayGroupMessage(clientSocket, frame);
+            continue;
+        }
 
-        std::cout << "Received from client: " << plaintext << std::endl;
+        MessageRef plaintext = decryptFromClient(frame, caesarKey);
+        if (frame.traceId != 0) {
+            recordSpan("server.decrypt", frame.traceId, receivedAt, traceNow(), clientSocket);
+        }
+        if (!plaintext) {
+            std::cerr << "Dropping malformed message." << std::endl;
+            continue;
+        }
 
-        for (const auto& otherClient : clients) {
-	    // sending stuff
-            if (otherClient.socket != clientSocket) {
-                std::cout << "With key: " << otherClient.publicKey << std::endl;
-                std::stringstream ss;
-		int caesarSendKey = resolveKey(otherClient.clientDHpublic, otherClient.serverDHPrivate, pVal);
-		std::string caesarReEncrypt = caesarEncrypt(caesarSendKey,plaintext.c_str());
-                std::vector<int> encryptedMessage = rsaEncrypt(caesarReEncrypt, otherClient.publicKey, otherClient.modulus);
-                std::cout << "Encrypted text: ";
+        if (frame.type == FRAME_CHAT) {
+            std::cout << "Received encrypted message from client: " << frame.payload << std::endl;
+            std::cout << "Received from client: ";
+            std::cout.write(plaintext.data(), plaintext.size()) << std::endl;
+            relayToOthers(clientSocket, plaintext, frame.traceId);
+        }
+        else if (frame.type == FRAME_STREAM_BEGIN) {
+            RelayStream& stream = relayStreams[frame.streamId];
+            stream.relayId = nextRelayStreamId++;
+            stream.recipients.clear();
+            std::cout << "Client started stream " << stream.relayId << ": ";
+            std::cout.write(plaintext.data(), plaintext.size()) << std::endl;
+            beginRelayStream(clientSocket, stream, plaintext);
+        }
+        else if (frame.type == FRAME_STREAM_CHUNK || frame.type == FRAME_STREAM_END) {
+            auto stream = relayStreams.find(frame.streamId);
+            if (stream == relayStreams.end()) {
+                continue;
+            }
+            relayStreamFrame(stream->second, frame.type, plaintext);
+            if (frame.type == FRAME_STREAM_END) {
+                std::cout << "Client finished stream " << stream->second.relayId << std::endl;
+                relayStreams.erase(stream);
+            }
+        }
+    }
 
-                for (int encryptedChar : encryptedMessage) {
-                    std::cout << encryptedChar << " ";
-                    ss << encryptedChar << " ";
-                }
-                std::cout << std::endl;
+    timers.cancel(heartbeat);
+
+    // Let recipients close out any transfer the client abandoned.
+    MessageRef empty = MessageRef::allocate(0);
+    for (auto& stream : relayStreams) {
+        relayStreamFrame(stream.second, FRAME_STREAM_END, empty);
+    }
 
-                std::string result = ss.str();
-                send(otherClient.socket, result.c_str(), result.length(), 0);
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        auto it = std::find_if(clients.begin(), clients.end(), [clientSocket](const ClientInfo& info) {
+            return info.socket == clientSocket;
+        });
+        if (it != clients.end()) {
+            // Rotate so the departed client cannot read what follows.
+            if (it->group) {
+                rotationPending = true;
+                membershipChanged.notify_one();
             }
+            clients.erase(it);
         }
     }
 
-    auto it = std::find_if(clients.begin(), clients.end(), [clientSocket](const ClientInfo& info) {
-        return info.socket == clientSocket;
-    });
-    if (it != clients.end()) {
-        clients.erase(it);
+    outbound->close();
+    close(clientSocket);
+    printMemoryStats();
+}
+
+// Hands the listening socket and every session to the upgrading process on
+// channel. On failure the sessions are resumed and false is returned; on
+// success nothing here may touch the sockets again.
+bool handOff(int channel, int serverSocket, HandshakePool& handshakes) {
+    std::cout << "Upgrade requested, quiescing sessions." << std::endl;
+
+    // The accept loop is stopped while we are here, so pending handshakes
+    // only finish or time out.
+    auto deadline = std::chrono::steady_clock::now() + HANDSHAKE_TIMEOUT + std::chrono::seconds(1);
+    while (handshakes.queueDepth() > 0 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
 
-    close(clientSocket);
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        rotationPaused = true;
+    }
+    sessionGate.close();
+    auto clientCount = [] {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        return clients.size();
+    };
+    bool quiet = handshakes.queueDepth() == 0 && sessionGate.waitParked(clientCount, HANDOFF_TIMEOUT);
+
+    // With every session parked nothing new is queued, so wait for what is
+    // already queued to reach the clients.
+    std::vector<ClientInfo> sessions;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        sessions = clients;
+    }
+    deadline = std::chrono::steady_clock::now() + HANDOFF_TIMEOUT;
+    for (const auto& client : sessions) {
+        while (quiet && client.outbound->memoryUsed() > 0) {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                quiet = false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    std::string keys;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        keys = "keys " + std::to_string(serverPublicKey) + " " + std::to_string(serverPrivateKey) + " " + std::to_string(serverModulus) + " " +
+               std::to_string(nextRelayStreamId.load()) + " " + encodeRoomKey(currentRoomKey) + " " + encodeRoomKey(previousRoomKey);
+    }
+    bool sent = quiet && sendRecord(channel, keys, serverSocket);
+    std::map<int, std::string> parked = sessionGate.parked();
+    for (const auto& client : sessions) {
+        if (!sent) {
+            break;
+        }
+        std::ostringstream record;
+        record << "session " << client.socket << " " << client.publicKey << " " << client.modulus << " " << client.clientDHpublic << " "
+               << client.serverDHPrivate << " " << client.caesarKey << " " << client.compression << " " << client.tracing << " " << client.group << " " << client.groupEpoch << " " << client.heartbeat
+               << parked[client.socket];
+        sent = sendRecord(channel, record.str(), client.socket);
+    }
+
+    std::string reply;
+    int unused;
+    if (sent && sendRecord(channel, "end") && receiveRecord(channel, reply, unused) && reply == "ok") {
+        std::cout << "Handed " << sessions.size() << " sessions to the new server." << std::endl;
+        return true;
+    }
+
+    std::cerr << "Upgrade failed, resuming sessions." << std::endl;
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        rotationPaused = false;
+        membershipChanged.notify_one();
+    }
+    sessionGate.reopen();
+    return false;
 }
 
-int main() {
-    int p = generateRandomPrime(10,100);
-    int q = generateRandomPrime(10,100);
-    int serverSocket, clientSocket;
-    struct sockaddr_in serverAddress, clientAddress;
-    socklen_t clientAddrLen = sizeof(clientAddress);
+// Takes over the listening socket, keys and sessions of the running server.
+// Returns the listening socket, or -1 if the handoff failed.
+int receiveHandoff() {
+    int channel = connectUpgradeSocket();
+    if (channel < 0) {
+        perror("No running server to upgrade");
+        return -1;
+    }
+
+    int serverSocket = -1;
+    uint32_t relayStreamId = 1;
+    // Each session with its streams as recorded by the old process, which
+    // name recipients by their old socket numbers.
+    std::vector<std::pair<ClientInfo, std::string>> sessions;
+    std::map<int, size_t> sessionBySocket;
+    std::string record;
+    int fd;
+    while (receiveRecord(channel, record, fd)) {
+        std::istringstream fields(record);
+        std::string kind;
+        fields >> kind;
+        if (kind == "keys" && fd >= 0) {
+            fields >> serverPublicKey >> serverPrivateKey >> serverModulus >> relayStreamId;
+            readRoomKey(fields, currentRoomKey);
+            readRoomKey(fields, previousRoomKey);
+            serverSocket = fd;
+        }
+        else if (kind == "session" && fd >= 0) {
+            ClientInfo info{};
+            info.socket = fd;
+            int oldSocket;
+            fields >> oldSocket >> info.publicKey >> info.modulus >> info.clientDHpublic >> info.serverDHPrivate >> info.caesarKey >> info.compression >> info.tracing >> info.group >> info.groupEpoch >> info.heartbeat;
+            std::string streams;
+            std::getline(fields, streams);
+            sessionBySocket[oldSocket] = sessions.size();
+            sessions.emplace_back(info, streams);
+        }
+        else if (kind == "end" && serverSocket >= 0) {
+            // Once the old process has the answer it exits, so from here on
+            // the sessions are ours alone.
+            bool acknowledged = sendRecord(channel, "ok");
+            close(channel);
+            if (!acknowledged) {
+                channel = -1;
+                break;
+            }
+            nextRelayStreamId = relayStreamId;
+            for (auto& session : sessions) {
+                session.first.outbound = std::make_shared<SendQueue>(session.first.socket);
+                // Rotate once the rotator runs, in case the old process
+                // had a rotation pending.
+                std::lock_guard<std::mutex> lock(clientsMutex);
+                clients.push_back(session.first);
+                rotationPending = rotationPending || session.first.group;
+            }
+            // Every session has its queue now, so stream recipients can be
+            // mapped from old sockets to the new sessions.
+            for (auto& session : sessions) {
+                std::map<uint32_t, RelayStream> relayStreams;
+                std::istringstream streams(session.second);
+                uint32_t from, to;
+                size_t count;
+                while (streams >> from >> to >> count) {
+                    RelayStream& stream = relayStreams[from];
+                    stream.relayId = to;
+                    int oldSocket;
+                    for (size_t i = 0; i < count && streams >> oldSocket; i++) {
+                        auto recipient = sessionBySocket.find(oldSocket);
+                        if (recipient != sessionBySocket.end()) {
+                            stream.recipients.push_back(sessions[recipient->second].first.outbound);
+                        }
+                    }
+                }
+                std::thread clientThread(handleClient, session.first, relayStreams);
+                clientThread.detach();
+            }
+            std::cout << "Took over " << sessions.size() << " sessions." << std::endl;
+            return serverSocket;
+        }
+        else {
+            if (fd >= 0) {
+                close(fd);
+            }
+            break;
+        }
+    }
+
+    std::cerr << "Upgrade handoff failed." << std::endl;
+    for (auto& session : sessions) {
+        close(session.first.socket);
+    }
+    if (serverSocket >= 0) {
+        close(serverSocket);
+    }
+    if (channel >= 0) {
+        close(channel);
+    }
+    return -1;
+}
+
+int listenForClients() {
+    int serverSocket;
+    struct sockaddr_in serverAddress;
 
     if ((serverSocket = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
         perror("Socket creation error");
@@ -300,27 +998,174 @@ int main() {
         return -1;
     }
 
-    if (listen(serverSocket, 3) < 0) {
+    // Admission control happens in HandshakePool, so let the kernel queue
+    // as many connections as it will.
+    if (listen(serverSocket, SOMAXCONN) < 0) {
         perror("Listen failed");
         return -1;
     }
+    return serverSocket;
+}
+
+// Parses a rate limit from the command line: a finite number, at least 0.
+bool parseRate(const char* text, double& rate) {
+    char* end;
+    errno = 0;
+    double value = std::strtod(text, &end);
+    if (end == text || *end != '\0' || errno != 0 || !std::isfinite(value) || value < 0) {
+        return false;
+    }
+    rate = value;
+    return true;
+}
+
+// Dumps the trace ring to server-trace-<pid>.json on every SIGUSR1.
+void traceDumper() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    int signal;
+    while (sigwait(&signals, &signal) == 0) {
+        std::string path = "server-trace-" + std::to_string(getpid()) + ".json";
+        if (dumpTrace(path)) {
+            std::cout << "Wrote trace to " << path << std::endl;
+        }
+        else {
+            std::cerr << "Could not write " << path << std::endl;
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    bool upgrade = false;
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (option == "--upgrade") {
+            upgrade = true;
+        }
+        else if (option == "--client-messages" && hasValue) {
+            if (!parseRate(argv[++i], clientMessageRate)) {
+                std::cerr << "Bad rate for " << option << ": " << argv[i] << std::endl;
+                return -1;
+            }
+        }
+        else if (option == "--client-bytes" && hasValue) {
+            if (!parseRate(argv[++i], clientByteRate)) {
+                std::cerr << "Bad rate for " << option << ": " << argv[i] << std::endl;
+                return -1;
+            }
+        }
+        else if (option == "--room-messages" && hasValue) {
+            if (!parseRate(argv[++i], roomMessageRate)) {
+                std::cerr << "Bad rate for " << option << ": " << argv[i] << std::endl;
+                return -1;
+            }
+        }
+        else if (option == "--room-bytes" && hasValue) {
+            if (!parseRate(argv[++i], roomByteRate)) {
+                std::cerr << "Bad rate for " << option << ": " << argv[i] << std::endl;
+                return -1;
+            }
+        }
+        else if (option == "--throttle" && hasValue) {
+            std::string mode = argv[++i];
+            if (mode != "delay" && mode != "reject") {
+                std::cerr << "Unknown throttle mode " << mode << ", expected delay or reject" << std::endl;
+                return -1;
+            }
+            rejectOverLimit = mode == "reject";
+        }
+        else {
+            std::cerr << "Unknown option or missing value: " << option << std::endl;
+            return -1;
+        }
+    }
+    configureLimiter(roomLimits, roomMessageRate, roomByteRate);
+
+    // Block SIGUSR1 before any thread starts so only traceDumper sees it.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    std::thread(traceDumper).detach();
+    int serverSocket, clientSocket;
+    struct sockaddr_in clientAddress;
+    socklen_t clientAddrLen = sizeof(clientAddress);
+
+    if (upgrade) {
+        // Keeps the old process's keys, so established clients notice nothing.
+        serverSocket = receiveHandoff();
+        if (serverSocket < 0) {
+            return -1;
+        }
+    }
+    else {
+        serverSocket = listenForClients();
+        if (serverSocket < 0) {
+            return -1;
+        }
+
+        generateKeyPair(serverModulus, serverPublicKey, serverPrivateKey);
+    }
 
     std::cout << "Server listening on port " << PORT << std::endl;
 
-    generateKeys(p, q, serverModulus, serverPublicKey, serverPrivateKey);
+    int upgradeSocket = openUpgradeSocket();
+    if (upgradeSocket < 0) {
+        perror("Upgrade socket unavailable");
+    }
+
+    std::thread(roomKeyRotator).detach();
+
+    std::thread([] { timers.run(); }).detach();
+
+    HandshakePool handshakes(serverPublicKey, serverModulus, timers, [](const HandshakeResult& handshake) {
+        std::thread clientThread(handleClient, registerClient(handshake), std::map<uint32_t, RelayStream>());
+        clientThread.detach();
+    });
+    rejectionReport.callback = [&handshakes] {
+        std::cout << "Rejected " << unreportedRejections.exchange(0) << " connections. ";
+        handshakes.printStats();
+    };
 
     while (true) {
+        pollfd fds[2] = {{serverSocket, POLLIN, 0}, {upgradeSocket, POLLIN, 0}};
+        if (poll(fds, upgradeSocket < 0 ? 1 : 2, -1) < 0) {
+            continue;
+        }
+        if (upgradeSocket >= 0 && (fds[1].revents & POLLIN)) {
+            int channel = accept(upgradeSocket, nullptr, nullptr);
+            if (channel >= 0 && !peerIsOwner(channel)) {
+                std::cerr << "Rejected upgrade from another user" << std::endl;
+                close(channel);
+                channel = -1;
+            }
+            if (channel >= 0 && handOff(channel, serverSocket, handshakes)) {
+                std::cout.flush();
+                _exit(0);
+            }
+            if (channel >= 0) {
+                close(channel);
+            }
+        }
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
+        clientAddrLen = sizeof(clientAddress);
         if ((clientSocket = accept(serverSocket, (struct sockaddr *)&clientAddress, &clientAddrLen)) < 0) {
+            // Running out of descriptors under a flood must not stop the server.
             perror("Accept failed");
-            return -1;
+            continue;
         }
 
-        std::thread clientThread(handleClient, clientSocket);
-        clientThread.detach();
-
-        if (!sendPublicKey(clientSocket, serverPublicKey, serverModulus)) {
+        if (!handshakes.submit(clientSocket, clientAddress)) {
             close(clientSocket);
-            return -1;
+            // The first rejection since the last report schedules the next.
+            if (unreportedRejections++ == 0) {
+                timers.arm(rejectionReport, REJECTION_REPORT_INTERVAL);
+            }
         }
     }
 